@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# Copyright (c) 2017-present, All rights reserved.
+# Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+#
+# This file is part of Dict2vec.
+#
+# Dict2vec is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Dict2vec is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License at the root of this repository for
+# more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Dict2vec.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmarks of dict2vec on a synthetic corpus, run by `make bench`. Each
+# setting below can be changed from the environment, for example:
+#
+#   BENCH_WORDS=100000000 BENCH_THREADS="1 8 16" make bench
+#
+# Results are appended to $BENCH_RESULTS as lines "name<TAB>value<TAB>unit"
+# after a header giving the commit and the machine. The names and their order
+# do not depend on the build, so the results of two builds can be compared
+# with: paste results-a.txt results-b.txt
+
+DATA_DIR=${BENCH_DIR:-./data/bench}
+RESULTS=${BENCH_RESULTS:-./bench-results.txt}
+
+# corpus and pairs
+WORDS=${BENCH_WORDS:-20000000}
+VOCAB=${BENCH_VOCAB:-200000}
+ZIPF=${BENCH_ZIPF:-1.0}
+STRONG=${BENCH_STRONG:-200000}
+WEAK=${BENCH_WEAK:-1000000}
+
+# end-to-end trainings, one per number of threads and vector size
+THREADS=${BENCH_THREADS:-"1 2 4 8"}
+SIZES=${BENCH_SIZES:-"100 300"}
+EPOCH=${BENCH_EPOCH:-1}
+
+CORPUS=$DATA_DIR/zipf-$WORDS-$VOCAB-$ZIPF.txt
+STRONG_PAIRS=$DATA_DIR/strong-$STRONG-$VOCAB.txt
+WEAK_PAIRS=$DATA_DIR/weak-$WEAK-$VOCAB.txt
+
+mkdir -p "$DATA_DIR"
+
+# generate the data once, files are named after their settings
+if [ ! -e "$CORPUS" ]; then
+  echo "Generating $CORPUS..."
+  ./dict2vec-bench corpus "$CORPUS" $WORDS $VOCAB $ZIPF || exit 1
+fi
+if [ ! -e "$STRONG_PAIRS" ]; then
+  echo "Generating $STRONG_PAIRS..."
+  ./dict2vec-bench pairs "$STRONG_PAIRS" $STRONG $VOCAB 1 || exit 1
+fi
+if [ ! -e "$WEAK_PAIRS" ]; then
+  echo "Generating $WEAK_PAIRS..."
+  ./dict2vec-bench pairs "$WEAK_PAIRS" $WEAK $VOCAB 2 || exit 1
+fi
+
+{
+  echo "# commit $(git rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+       "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+  echo "# cpu $(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | \
+       sed 's/^ *//'), $(nproc) cores"
+  echo "# corpus $WORDS words, $VOCAB words vocabulary, zipf $ZIPF," \
+       "$STRONG strong and $WEAK weak pairs"
+} >> "$RESULTS"
+
+# the negative samples must follow count^0.75 before anything is timed
+echo "Checking the distribution of the negative samples..."
+./dict2vec-bench alias -input "$CORPUS" > "$DATA_DIR/alias.log"
+status=$?
+grep -e '^alias table' -e '^ERROR' "$DATA_DIR/alias.log"
+[ $status -eq 0 ] || exit 1
+
+# microbenchmarks
+echo "Running microbenchmarks..."
+./dict2vec-bench micro "$RESULTS" -input "$CORPUS" \
+  -strong-file "$STRONG_PAIRS" -weak-file "$WEAK_PAIRS" \
+  -output "$DATA_DIR/micro" -size 100 > /dev/null || exit 1
+
+# end-to-end words/sec, read from the metrics of the last epoch
+for size in $SIZES; do
+  for threads in $THREADS; do
+    echo "Training with -size $size -threads $threads..."
+    rm -f "$DATA_DIR/metrics.jsonl"
+    ./dict2vec -input "$CORPUS" -output "$DATA_DIR/e2e" \
+      -strong-file "$STRONG_PAIRS" -weak-file "$WEAK_PAIRS" \
+      -size $size -window 5 -negative 5 -strong-draws 4 -weak-draws 5 \
+      -sample 1e-4 -threads $threads -epoch $EPOCH -binary 2 \
+      -metrics "$DATA_DIR/metrics.jsonl" -metrics-every 0 > /dev/null || exit 1
+
+    speed=$(grep '"type":"progress"' "$DATA_DIR/metrics.jsonl" | tail -1 | \
+            sed 's/.*"words_per_sec":\([0-9.]*\),"negatives".*/\1/')
+    train=$(grep '"phase":"train"' "$DATA_DIR/metrics.jsonl" | \
+            sed 's/.*"seconds":\([0-9.]*\)}/\1/')
+    printf "train_size%s_threads%s\t%s\twords/s\n" $size $threads $speed \
+      >> "$RESULTS"
+    printf "train_size%s_threads%s_time\t%s\ts\n" $size $threads $train \
+      >> "$RESULTS"
+  done
+done
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,429 @@
+/* Copyright (c) 2017-present, All rights reserved.
+ * Written by Julien Tissier <30314448+tca19@users.noreply.github.com>
+ *
+ * This file is part of Dict2vec.
+ *
+ * Dict2vec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Dict2vec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License at the root of this repository for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Dict2vec.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks of dict2vec, run by `make bench` (see bench.sh):
+ *
+ *   corpus <file> <words> <vocab> <s>
+ *     write <words> words drawn from <vocab> words with a Zipf law of
+ *     exponent <s> (the word of rank r has a probability ~ 1 / (r+1)^s)
+ *   pairs <file> <pairs> <vocab> <seed>
+ *     write <pairs> pairs of words of the corpus, with ranks drawn from a
+ *     log-uniform law so frequent words have more pairs, as in dictionaries
+ *   micro <results> <dict2vec options>
+ *     time the main functions of dict2vec on the -input corpus and the pair
+ *     files, and append one line per result to <results>
+ *   alias <dict2vec options>
+ *     check with a chi-squared test that the negative samples drawn from the
+ *     alias table follow the law count^neg_power of the -input corpus, and
+ *     fail if they do not
+ *
+ * The word of rank r is r written in bijective base 70, each digit being a
+ * consonant-vowel syllable, so the most frequent words are the shortest.
+ * Results are lines "name<TAB>value<TAB>unit", in the same order for each
+ * build, so two result files can be compared line by line.
+ */
+#define DICT2VEC_NO_MAIN
+#include "dict2vec.c"
+
+#define SYLLABLES    70
+#define LINE_WORDS   1000               /* words per line of the corpus */
+#define SAMPLE_BYTES (16L * 1024 * 1024) /* corpus read by lookup benchmarks */
+#define DRAWS        20000000           /* draws of the sampling benchmarks */
+#define UPDATES      2000000            /* updates of the kernel benchmark */
+#define ALIAS_DRAWS  100000000          /* draws of the alias table check */
+#define ALIAS_MIN    20.0               /* expected draws of a chi2 class */
+#define ALIAS_MAX_Z  5.0                /* rejection of the chi2 test */
+
+uint64_t bench_rng = 0x9E3779B97F4A7C15ULL;
+volatile long sink;   /* results of the benchmarks, so they are computed */
+FILE *results;
+
+/* bench_random: next value of the xorshift64* generator of the benchmarks */
+static inline uint64_t bench_random()
+{
+	bench_rng ^= bench_rng >> 12;
+	bench_rng ^= bench_rng << 25;
+	bench_rng ^= bench_rng >> 27;
+	return bench_rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* bench_uniform: uniform double in [0, 1) */
+static inline double bench_uniform()
+{
+	return (bench_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* make_word: write the word of rank r in w and return its length */
+int make_word(long r, char *w)
+{
+	static const char cons[] = "bdfgklmnprstvz", vow[] = "aeiou";
+	int len = 0, d;
+
+	for (++r; r > 0; r = (r - 1) / SYLLABLES)
+	{
+		d = (r - 1) % SYLLABLES;
+		w[len++] = cons[d / 5];
+		w[len++] = vow[d % 5];
+	}
+	w[len] = '\0';
+	return len;
+}
+
+/* gen_corpus: write a corpus of n words from a Zipf law of exponent s over
+ * vocab words in filename */
+void gen_corpus(char *filename, long n, long vocab, double s)
+{
+	double *cdf, u;
+	long i, lo, hi, mid;
+	char w[64];
+	int len;
+	FILE *fo;
+
+	if ((cdf = malloc(vocab * sizeof *cdf)) == NULL)
+	{
+		printf("Cannot allocate memory for the Zipf law\n");
+		exit(1);
+	}
+	for (i = 0, u = 0; i < vocab; ++i)
+		cdf[i] = (u += pow(i + 1, -s));
+	for (i = 0; i < vocab; ++i)
+		cdf[i] /= u;
+
+	if ((fo = fopen(filename, "w")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		/* first rank whose cumulative probability is at least u */
+		u = bench_uniform();
+		for (lo = 0, hi = vocab - 1; lo < hi;)
+		{
+			mid = lo + (hi - lo) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		len = make_word(lo, w);
+		w[len] = ((i + 1) % LINE_WORDS) ? ' ' : '\n';
+		fwrite(w, 1, len + 1, fo);
+	}
+
+	fclose(fo);
+	free(cdf);
+}
+
+/* gen_pairs: write n pairs of words among the first vocab ranks */
+void gen_pairs(char *filename, long n, long vocab)
+{
+	char a[64], b[64];
+	long i, r1, r2;
+	FILE *fo;
+
+	if ((fo = fopen(filename, "w")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		do
+		{
+			r1 = exp(bench_uniform() * log(vocab)) - 1;
+			r2 = exp(bench_uniform() * log(vocab)) - 1;
+		}
+		while (r1 == r2);
+
+		make_word(r1, a);
+		make_word(r2, b);
+		fprintf(fo, "%s %s\n", a, b);
+	}
+
+	fclose(fo);
+}
+
+/* report: append a result to the results file */
+void report(const char *name, double value, const char *unit)
+{
+	fprintf(results, "%s\t%.3f\t%s\n", name, value, unit);
+	fflush(results);
+}
+
+/* bench_contains: time contains() on sorted arrays of size values */
+void bench_contains(int size)
+{
+	char name[32];
+	int *array, i;
+	long n, found = 0;
+	double t;
+
+	array = malloc(size * sizeof *array);
+	for (i = 0; i < size; ++i)
+		array[i] = 4 * i + bench_random() % 4;
+
+	t = wall_time();
+	for (n = 0; n < DRAWS; ++n)
+		found += contains(array, bench_random() % (4 * size), size);
+	sprintf(name, "contains_%d", size);
+	report(name, (wall_time() - t) * 1e9 / DRAWS, "ns/op");
+
+	sink = found;
+	free(array);
+}
+
+/* micro: time the main functions of dict2vec with the options of argv */
+void micro(int argc, char **argv)
+{
+	char spairs_file[MAXLEN] = "", wpairs_file[MAXLEN] = "";
+	char *data, *p, *end, **words;
+	int *lens, len, target, w_c;
+	long size, n, i, found, max_words = SAMPLE_BYTES / 2;
+	float *hidden, dot, grad;
+	struct sampler smp;
+	double t;
+
+	parse_args(argc, argv, &args, spairs_file, wpairs_file);
+	vocab = calloc(vocab_max_size, sizeof *vocab);
+	words = malloc(max_words * sizeof *words);
+	lens  = malloc(max_words * sizeof *lens);
+	if (vocab == NULL || words == NULL || lens == NULL)
+	{
+		printf("Cannot allocate memory for the benchmarks\n");
+		exit(1);
+	}
+	init_kernels(args.simd);
+	init_sigmoid(args.sigmoid);
+	init_metrics();
+
+	/* words of the beginning of the corpus, for the lookups */
+	if ((data = map_file(args.input, &size)) == NULL)
+	{
+		printf("ERROR: training data file not found or empty!\n");
+		exit(1);
+	}
+	end = data + (size < SAMPLE_BYTES ? size : SAMPLE_BYTES);
+	for (p = data, n = 0; n < max_words &&
+	     (len = next_token(&p, end, &words[n])) > 0; ++n)
+		lens[n] = len;
+
+	/* add_word: count the sample in an empty vocabulary */
+	resize_vocab_hash(0);
+	t = wall_time();
+	for (i = 0; i < n; ++i)
+		add_word(words[i], lens[i], 1);
+	report("add_word", (wall_time() - t) * 1e9 / n, "ns/op");
+	vocab_size = strings.size = 0;
+
+	read_vocab(args.input, spairs_file, wpairs_file);
+
+	t = wall_time();
+	for (i = 0, found = 0; i < n; ++i)
+		found += hash_string(words[i], lens[i]);
+	report("hash", (wall_time() - t) * 1e9 / n, "ns/op");
+
+	t = wall_time();
+	for (i = 0; i < n; ++i)
+		found += search_vocab(words[i], lens[i]);
+	report("find", (wall_time() - t) * 1e9 / n, "ns/op");
+	sink = found;
+
+	/* sampling */
+	init_negative_table();
+	init_sampler(&smp);
+	seed_sampler(&smp, 0);
+	t = wall_time();
+	for (i = 0, found = 0; i < DRAWS; ++i)
+		found += draw_negative(&smp);
+	report("draw_negative", (wall_time() - t) * 1e9 / DRAWS, "ns/op");
+	sink = found;
+
+	bench_contains(8);
+	bench_contains(64);
+	bench_contains(1024);
+
+	/* pairs lookups of the training: a context and a negative sample */
+	t = wall_time();
+	for (i = 0, found = 0; i < DRAWS; ++i)
+	{
+		w_c    = draw_negative(&smp);
+		target = draw_negative(&smp);
+		found += has_pair(&strong, w_c, target) +
+		         has_pair(&weak, w_c, target);
+	}
+	report("has_pair", (wall_time() - t) * 1e9 / DRAWS, "ns/2 ops");
+	sink = found;
+
+	/* one update of the training: dot product, sigmoid, back-propagation
+	 * of a context word and a negative sample */
+	init_network();
+	hidden = calloc(args.dim, sizeof *hidden);
+	t = wall_time();
+	for (i = 0; i < UPDATES; ++i)
+	{
+		w_c    = draw_negative(&smp);
+		target = draw_negative(&smp);
+		dot    = kern.dot(WI + w_c * row_size, WO + target * row_size,
+		                  args.dim);
+		grad   = args.alpha * (0 - sigmoid(dot));
+		kern.backprop(hidden, WO + target * row_size,
+		              WI + w_c * row_size, grad, args.dim);
+	}
+	report("update", (wall_time() - t) * 1e9 / UPDATES, "ns/op");
+
+	/* saving, in the 3 formats */
+	for (args.binary = 0; args.binary < 3; ++args.binary)
+	{
+		t = wall_time();
+		save_vectors(args.output, -1);
+		report(args.binary == 0 ? "save_text" : args.binary == 1 ?
+		       "save_word2vec" : "save_native",
+		       (wall_time() - t) * 1e3, "ms");
+	}
+
+	free(hidden);
+	destroy_sampler(&smp);
+	free(table);
+	destroy_network();
+	destroy_vocab();
+	close_corpus();
+	destroy_metrics();
+	munmap(data, size);
+	free(lens);
+	free(words);
+	free(vocab_hash);
+}
+
+/* check_alias: draw ALIAS_DRAWS negative samples and compare their counts
+ * to count^neg_power / sum with a chi-squared test. Words are sorted by
+ * decreasing count, so consecutive rare words are grouped until each class
+ * expects at least ALIAS_MIN draws. With many classes, the statistic is close
+ * to a normal law of mean df and variance 2 df: the test fails if it is more
+ * than ALIAS_MAX_Z standard deviations above its mean. Return 0 on success.
+ */
+int check_alias(int argc, char **argv)
+{
+	char spairs_file[MAXLEN] = "", wpairs_file[MAXLEN] = "";
+	double sum, expected, observed, chi2, z;
+	long i, n, df, *drawn;
+	struct sampler smp;
+
+	parse_args(argc, argv, &args, spairs_file, wpairs_file);
+	if ((vocab = calloc(vocab_max_size, sizeof *vocab)) == NULL)
+	{
+		printf("Cannot allocate memory for the vocabulary\n");
+		exit(1);
+	}
+	init_metrics();
+	read_vocab(args.input, spairs_file, wpairs_file);
+	if ((drawn = calloc(vocab_size, sizeof *drawn)) == NULL)
+	{
+		printf("Cannot allocate memory for the draws\n");
+		exit(1);
+	}
+
+	init_negative_table();
+	init_sampler(&smp);
+	seed_sampler(&smp, 0);
+	for (n = 0; n < ALIAS_DRAWS; ++n)
+		drawn[draw_negative(&smp)]++;
+
+	for (i = 0, sum = 0.0; i < vocab_size; ++i)
+		sum += pow(vocab[i].count, args.neg_power);
+
+	/* the last class takes the remaining words, whatever they expect */
+	chi2 = expected = observed = 0.0;
+	for (i = 0, df = -1; i < vocab_size; ++i)
+	{
+		expected += ALIAS_DRAWS * pow(vocab[i].count, args.neg_power) /
+		            sum;
+		observed += drawn[i];
+		if (expected < ALIAS_MIN && i < vocab_size - 1)
+			continue;
+
+		chi2 += (observed - expected) * (observed - expected) /
+		        expected;
+		expected = observed = 0.0;
+		++df;
+	}
+	z = (df > 0) ? (chi2 - df) / sqrt(2.0 * df) : 0.0;
+
+	printf("alias table: %ld draws, %ld words, chi2 %.1f for %ld degrees "
+	       "of freedom (z = %.2f)\n", n, vocab_size, chi2, df, z);
+
+	destroy_sampler(&smp);
+	free(drawn);
+	free(table);
+	destroy_vocab();
+	close_corpus();
+	destroy_metrics();
+	free(vocab_hash);
+
+	if (z > ALIAS_MAX_Z)
+	{
+		printf("ERROR: negative samples do not follow count^%g\n",
+		       args.neg_power);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 6 && strcmp(argv[1], "corpus") == 0)
+		gen_corpus(argv[2], atol(argv[3]), atol(argv[4]), atof(argv[5]));
+
+	else if (argc == 6 && strcmp(argv[1], "pairs") == 0)
+	{
+		bench_rng += atol(argv[5]);
+		gen_pairs(argv[2], atol(argv[3]), atol(argv[4]));
+	}
+
+	else if (argc >= 3 && strcmp(argv[1], "micro") == 0)
+	{
+		if ((results = fopen(argv[2], "a")) == NULL)
+		{
+			printf("Cannot open %s: permission denied\n", argv[2]);
+			exit(1);
+		}
+		micro(argc - 2, argv + 2);
+		fclose(results);
+	}
+
+	else if (argc >= 2 && strcmp(argv[1], "alias") == 0)
+		return check_alias(argc - 1, argv + 1);
+
+	else
+	{
+		printf("Usage:\n"
+		       "  %s corpus <file> <words> <vocab> <s>\n"
+		       "  %s pairs <file> <pairs> <vocab> <seed>\n"
+		       "  %s micro <results> <dict2vec options>\n"
+		       "  %s alias <dict2vec options>\n",
+		       argv[0], argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	return 0;
+}
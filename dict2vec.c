@@ -18,6 +18,8 @@
  * along with Dict2vec.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,42 +27,87 @@
 #include <string.h>      /* strcat */
 #include <math.h>
 #include <pthread.h>
+#include <time.h>        /* clock, clock_gettime */
+#include <fcntl.h>       /* open */
+#include <unistd.h>      /* close */
+#include <sys/mman.h>    /* mmap, madvise */
+#include <sys/stat.h>    /* fstat */
+#include <sys/syscall.h> /* SYS_mbind */
+#include <sched.h>       /* sched_getaffinity */
+#include <signal.h>      /* signal */
+#include <sys/socket.h>  /* socket, connect */
+#include <sys/un.h>      /* sockaddr_un */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   /* SSE2, AVX2 and AVX-512 intrinsics */
+#define HAVE_X86_KERNELS
+#endif
 
 #define MAXLEN       100
 #define MAXLINE      1000
+#define MAX_NODES    64
 
 #define SIGMOID_SIZE 512
 #define MAX_SIGMOID  4
 
-#define HASHSIZE     30000000
+/* the fine sigmoid table has FINE_SIZE values on [-FINE_MAX, FINE_MAX] */
+#define FINE_SIZE    8192
+#define FINE_MAX     8
+
+/* neighbor lists up to PAIRS_LINEAR words are scanned linearly, lists with
+ * more than PAIRS_HASHED words also get a hash set, others are searched with
+ * a binary search */
+#define PAIRS_LINEAR 16
+#define PAIRS_HASHED 256
+
+/* The vocabulary hash table is an open addressing table of a power of 2
+ * cells, kept at most half full. Each cell holds the index of a word in vocab
+ * and the high 32 bits of its hash, so a lookup only compares the strings of
+ * words with the same fingerprint. The table grows with the vocabulary and is
+ * rebuilt at the size of the final vocabulary once it is sorted.
+ */
+struct vocab_cell
+{
+	uint32_t fingerprint;   /* high 32 bits of the hash of the word */
+	int      index;         /* index of the word in vocab, -1 if empty */
+};
 
+/* The strings of the words are stored one after the other, each ended by
+ * '\0', in a single arena, instead of one malloc per word. Entries refer to
+ * them by offset, so the arena can be reallocated as it grows. Once the
+ * vocabulary is sorted, the arena is packed in the order of the words, so
+ * the strings of frequent words share cache lines.
+ * The fields of the words are split by use: vocab holds the cold fields read
+ * to build the vocabulary and save the vectors, and pdiscard, read for each
+ * token during training, is a separate array of floats.
+ */
 struct entry
 {
-	/* Words forming a strong pair with this entry are stored in the array
-	 * sp[] (only the index of words are stored). Instead of calculating a
-	 * new random index in sp[], the indexes are randomly shuffled at the
-	 * beginning and a sliding cursor indicates the current word to draw
-	 * (faster because no need to compute a lot of random indexes).
-	 * Weak pairs follow the same implementation.
-	 */
-	int n_sp;       /* number of strong pairs of entry */
-	int pos_sp;     /* current cursor position in sp[] */
-	int *sp;
-
-	int n_wp;       /* number of weak pairs of entry */
-	int pos_wp;     /* current cursor position in wp[] */
-	int *wp;
-
-
-	long  count;    /* number of occurrences of entry in input file */
-	char  *word;    /* string associated to the entry */
-	float pdiscard; /* probability to discard entry when found in input */
+	long count;     /* number of occurrences of entry in input file */
+	long word;      /* offset of the string of entry in strings */
+};
+
+struct arena
+{
+	char *data;
+	long size;      /* bytes used */
+	long capacity;  /* bytes allocated */
 };
 
 struct parameters
 {
 	char input[MAXLEN];
 	char output[MAXLEN];
+	char cache[MAXLEN];
+	char simd[MAXLEN];
+	char sigmoid[MAXLEN];
+	char quantize[MAXLEN];
+	char checkpoint[MAXLEN];
+	char resume[MAXLEN];
+	char metrics[MAXLEN];
+	char read_vocab[MAXLEN];
+	char save_vocab[MAXLEN];
+	char input_cmd[MAXLINE];
 
 	int dim;
 	int window;
@@ -71,21 +118,231 @@ struct parameters
 	int num_threads;
 	int epoch;
 	int save_each_epoch;
+	int cache_varint;
+	int shared_negatives;
+	int binary;
+	int pq_m;
+	int checkpoint_every;
+	int pin;
+	int numa;
+	int huge_pages;
+	int hot_rows;
+	int hot_sync;
+	int metrics_every;
+	int readers;
+	int queue_depth;
 
 	float alpha;
 	float starting_alpha;
 	float sample;
 	float beta_strong;
 	float beta_weak;
+	float neg_power;
+};
+
+/* The input file is mapped once in memory and shared by all threads. Tokens
+ * are read directly from the mapped pages, so there is no copy into a buffer
+ * and no FILE* per thread.
+ */
+struct corpus
+{
+	char *data;     /* first byte of the mapped file */
+	char *end;      /* one byte past the last byte of the mapped file */
+};
+
+/* The input file can be encoded once into a file containing only the index
+ * in vocab of each word (words not in vocab are dropped). Training then reads
+ * indexes from this file instead of parsing and hashing text. Indexes are
+ * stored either as 32 bits integers or as varints (7 bits per byte, the high
+ * bit is set on all bytes of an index except the last one).
+ */
+struct id_cache_header
+{
+	char     magic[4];     /* "D2VI" */
+	uint32_t varint;       /* 1 if indexes are varints, 0 otherwise */
+	uint64_t fingerprint;  /* fingerprint of the vocabulary */
+	uint64_t vocab_size;
+	uint64_t n_ids;        /* number of indexes in the file */
+	uint64_t data_size;    /* number of bytes after the header */
+};
+
+struct id_cache
+{
+	char *map;      /* whole mapped file (header + indexes) */
+	long map_size;
+	char *data;     /* first byte of the indexes */
+	char *end;      /* one byte past the last index */
+	int  varint;
+};
+
+/* Strong (and weak) pairs of all words are stored in compressed sparse row
+ * format: the indexes of words forming a pair with word i are
+ * neighbors[offsets[i]] ... neighbors[offsets[i+1] - 1], sorted and without
+ * duplicates. All lists are in one contiguous block of memory.
+ */
+struct pairs
+{
+	long *offsets;   /* vocab_size + 1 cells */
+	int  *neighbors;
+
+	/* words with more than PAIRS_HASHED neighbors also have a hash set
+	 * of their neighbors in sets[set_offsets[i]] ...
+	 * sets[set_offsets[i+1] - 1]. The size of each set is a power of 2
+	 * and empty cells are -1. */
+	long *set_offsets;
+	int  *sets;
+};
+
+/* Sampling state owned by one training thread. Nothing in it is shared, so
+ * threads never write to the same cache lines when they draw samples, and
+ * the samples drawn by a thread only depend on its id. The generator and the
+ * cursors keep running from one epoch to the next, so each epoch draws other
+ * samples, as the global cursors of the original code did.
+ *
+ * Words forming a strong pair with a word w are drawn in order from its
+ * neighbor list (faster than computing a lot of random indexes). The cursor
+ * in this list is pos_sp[paired[w]], only words with at least one pair have
+ * a cursor. Weak pairs follow the same implementation.
+ */
+struct sampler
+{
+	uint64_t rng;      /* state of the xorshift64* generator */
+	int  *pos_sp;      /* cursor in strong pairs of each paired word */
+	int  *pos_wp;      /* cursor in weak pairs of each paired word */
+};
+
+/* Negative samples are drawn with the alias method: pick a random cell i
+ * of the table (one per word), then return i with probability prob, or
+ * alias otherwise. Both fields are in the same cell so a draw reads one
+ * cache line.
+ */
+struct alias
+{
+	float prob;
+	int   alias;
+};
+
+/* With -numa 1, the pages of WI, WO and the negative table are interleaved
+ * over all NUMA nodes, and threads are spread over the nodes by blocks
+ * (thread i runs on the CPUs of node i * nodes / threads). With -numa 2, the
+ * chunks of the input are also split in one range per node, trained first by
+ * the threads of this node. The nodes are read from sysfs and memory is
+ * placed with the mbind system call, so libnuma is not needed.
+ */
+struct numa
+{
+	int n_nodes;                 /* nodes with CPUs usable by the process */
+	int ids[MAX_NODES];          /* number of each node in sysfs */
+	cpu_set_t cpus[MAX_NODES];   /* usable CPUs of each node */
+	unsigned long mask;          /* all nodes, for interleaving */
+};
+
+/* With -checkpoint, the whole training state is saved at the end of each
+ * epoch and every -checkpoint-every seconds during an epoch. To save during
+ * an epoch, the main thread sets request; each training thread stops before
+ * reading its next line and copies its state (cursor in the input, counters
+ * and sampler) in states[]. Once all running threads are stopped, WI and WO
+ * are copied, the threads are released and the copy is written to disk while
+ * they train. A checkpoint restarts training in the same state (bit-for-bit
+ * with one thread, Hogwild updates of several threads are not reproducible
+ * anyway).
+ */
+struct thread_state
+{
+	long     cur;                /* offset of the cursor in the input */
+	long     end;                /* offset of the end of its chunk */
+	long     word_count_local, negsamp_discarded, negsamp_total;
+	uint64_t rng;                /* generator of the sampler */
+	int      rnd;                /* generator used for subsampling */
+	int      pad;
+};
+
+struct checkpoint
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int   request;         /* threads must stop before their next line */
+	int   stopped;         /* threads stopped for the copy */
+	int   running;         /* threads still training in this epoch */
+	int   resume;          /* threads restart from states[] */
+	long  generation;      /* number of copies done */
+	struct thread_state *states;
+	int   *pos_sp, *pos_wp;  /* pairs cursors, n_paired + 1 per thread */
+	float *WI, *WO;        /* copy of the matrices */
+	long  word_count_actual, negsamp_rejected;
+	long  next_chunk[MAX_NODES];  /* chunk counters of the partitions */
+	float alpha;
+	int   input_kind;      /* INPUT_* read by the saved threads */
+	long  input_bytes;     /* size of the text or id cache they read */
+};
+
+/* offsets of the thread states and chunks are in the text of the input, or
+ * in the id cache (fixed size or varint indexes) with -cache */
+enum { INPUT_TEXT, INPUT_IDS, INPUT_VARINTS };
+
+struct checkpoint_header
+{
+	char     magic[4];         /* "D2VC" */
+	uint32_t mid_epoch;        /* 1 if saved during an epoch */
+	uint64_t input_size;       /* size of the -input file */
+	uint64_t vocab_size;
+	uint64_t dim;
+	uint64_t num_threads;
+	uint64_t n_paired;
+	uint64_t train_words;
+	uint64_t word_count_actual;
+	uint64_t negsamp_rejected;
+	uint64_t epoch;            /* epoch being trained, or epochs done */
+	uint64_t n_strong, n_weak; /* number of strong and weak pairs */
+	uint64_t n_parts;          /* partitions of the input (1 per node) */
+	uint64_t input_bytes;      /* size of the text or id cache read */
+	float    alpha;
+	uint32_t input_kind;       /* INPUT_* read by the threads */
+};
+
+/* With -metrics <file>, the training is described by JSON lines appended to
+ * <file>, or sent to it if it is a Unix socket (stream) a dashboard listens
+ * on. Every -metrics-every seconds and at the end of each epoch, a
+ * "progress" line gives the words/sec (total and per thread) since the last
+ * line, the learning rate, and the negative samples used, rejected and pairs
+ * drawn since the start. A "phase" line gives the duration of each phase of
+ * the run as it ends. With -readers, a "queue" line gives the time spent
+ * waiting on the queue of sentences in each epoch. Times are wall-clock
+ * seconds since the start.
+ * Training threads publish their counters with atomic stores every few
+ * thousand words; the main thread reads them without stopping the threads.
+ */
+enum { PHASE_VOCAB, PHASE_PAIRS, PHASE_INIT, PHASE_TRAIN, PHASE_SAVE,
+       N_PHASES };
+
+struct counters
+{
+	long words;        /* words read since the start */
+	long negatives;    /* negative samples used */
+	long discarded;    /* negative samples rejected (pairs) */
+	long pair_draws;   /* strong and weak pairs drawn */
+	char pad[32];      /* one cache line per thread */
+};
+
+struct metrics
+{
+	FILE   *out;
+	double begin;             /* wall-clock time of the start */
+	double last;              /* time of the last progress line */
+	long   *words;            /* words of each thread at this line */
+	long   *last_words;       /* and at the previous one */
+	struct counters *threads;
 };
 
 /* dynamic array containing 1 entry for each word in vocabulary */
 struct entry *vocab;
+struct arena strings; /* strings of the words of vocab */
+float *pdiscard;      /* probability to keep each word when found in input */
 
 struct parameters args = {
-	"", "",
-	100, 5, 5, 5, 0, 0, 1, 1, 0,
-	0.025, 0.025, 1e-4, 1.0, 0.25
+	"", "", "", "", "", "", "", "", "", "", "", "",
+	100, 5, 5, 5, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10000, 10, 0, 4,
+	0.025, 0.025, 1e-4, 1.0, 0.25, 0.75
 };
 
 /* variables required for processing input file */
@@ -93,13 +350,44 @@ long vocab_max_size = 10000, vocab_size = 0, train_words = 0, file_size = 0,
 	word_count_actual = 0;
 
 
-int *vocab_hash;   /* hash table to know index of a word */
+struct vocab_cell *vocab_hash; /* hash table to know index of a word */
+long vocab_hash_size = 0;      /* number of cells of vocab_hash */
 float *WI, *WO;    /* weight matrices */
-int *table;        /* array of indexes for negative sampling */
+long row_size;     /* floats between two rows of WI and WO */
+long matrix_bytes; /* bytes mapped for each of WI and WO */
+struct alias *table; /* alias table for negative sampling */
+struct corpus corpus;
+struct id_cache ids;
+struct pairs strong, weak;
+int *paired;       /* rank of each word among words with pairs, or -1 */
+long n_paired;     /* number of words with at least one pair */
+
+/* The sigmoid can be computed in 3 ways (-sigmoid option):
+ *   table     the 512 values below on [-MAX_SIGMOID, MAX_SIGMOID], 0 or 1
+ *             outside (default)
+ *   fine      a table of FINE_SIZE values generated at startup on
+ *             [-FINE_MAX, FINE_MAX], error under 4e-4
+ *   rational  a Pade approximation of tanh on [-RATIONAL_MAX, RATIONAL_MAX],
+ *             error under 5e-5, without any memory access
+ * All modes are branchless and return exactly 0 or 1 outside their range, so
+ * strong and weak pairs updates whose gradient is 0 are skipped in all modes
+ * (fine and rational, with a wider range, skip fewer of them than table).
+ * Like the training kernels, the functions of the mode are selected once by
+ * init_sigmoid(). sigmoid_vec() evaluates a whole array of dot products at
+ * once so the rational mode is vectorized by the compiler.
+ */
+#define RATIONAL_MAX 9.94
 
-static float sigmoid(const float x)
+struct sigmoids
 {
-	static float values[] = {
+	const char *name;
+	float (*one)(float x);
+	void  (*vec)(const float *x, float *out, int n);
+};
+
+float fine_values[FINE_SIZE];
+
+static const float sigmoid_values[SIGMOID_SIZE] = {
 		0.0180, 0.0183, 0.0185, 0.0188, 0.0191, 0.0194, 0.0197, 0.0200,
 		0.0203, 0.0206, 0.0210, 0.0213, 0.0216, 0.0219, 0.0223, 0.0226,
 		0.0230, 0.0233, 0.0237, 0.0241, 0.0244, 0.0248, 0.0252, 0.0256,
@@ -164,738 +452,5077 @@ static float sigmoid(const float x)
 		0.9740, 0.9744, 0.9748, 0.9752, 0.9756, 0.9759, 0.9763, 0.9767,
 		0.9770, 0.9774, 0.9777, 0.9781, 0.9784, 0.9787, 0.9790, 0.9794,
 		0.9797, 0.9800, 0.9803, 0.9806, 0.9809, 0.9812, 0.9815, 0.9817,
-	};
+};
+
+/* sigmoid_table: 1 above MAX_SIGMOID, 0 under -MAX_SIGMOID */
+static inline float sigmoid_table(float x)
+{
+	float c = fminf(fmaxf(x, -MAX_SIGMOID), MAX_SIGMOID);
+	int index;
+
+	/* x == MAX_SIGMOID would give index SIGMOID_SIZE */
+	index = ((c / MAX_SIGMOID) + 1) / 2 * SIGMOID_SIZE;
+	index = (index > SIGMOID_SIZE - 1) ? SIGMOID_SIZE - 1 : index;
+	c = sigmoid_values[index];
+	c = (x > MAX_SIGMOID) ? 1.0 : c;
+	return (x < -MAX_SIGMOID) ? 0.0 : c;
+}
 
-	static int index;
+/* sigmoid_fine: 1 above FINE_MAX, 0 under -FINE_MAX */
+static inline float sigmoid_fine(float x)
+{
+	float c = fminf(fmaxf(x, -FINE_MAX), FINE_MAX);
+	int index = (c + FINE_MAX) * (FINE_SIZE / (2.0 * FINE_MAX));
 
-	index = ((x / MAX_SIGMOID) + 1) / 2 * SIGMOID_SIZE;
-	return values[index];
+	c = fine_values[(index > FINE_SIZE - 1) ? FINE_SIZE - 1 : index];
+	c = (x > FINE_MAX) ? 1.0 : c;
+	return (x < -FINE_MAX) ? 0.0 : c;
 }
 
-/* other variables */
-clock_t start;
-int current_epoch = 0, table_size = 1e7, neg_pos = 0;
+/* sigmoid_rational: sigmoid(x) = (1 + tanh(x/2)) / 2, tanh being replaced by
+ * its [7/6] Pade approximant, accurate up to |x| = RATIONAL_MAX. 1 above,
+ * 0 under -RATIONAL_MAX */
+static inline float sigmoid_rational(float x)
+{
+	float t = fminf(fmaxf(0.5 * x, -0.5 * RATIONAL_MAX),
+	                0.5 * RATIONAL_MAX), t2 = t * t;
+	float p = t * (135135.0 + t2 * (17325.0 + t2 * (378.0 + t2)));
+	float q = 135135.0 + t2 * (62370.0 + t2 * (3150.0 + t2 * 28.0));
+	float c = 0.5 + 0.5 * p / q;
+
+	c = (x > RATIONAL_MAX) ? 1.0 : c;
+	return (x < -RATIONAL_MAX) ? 0.0 : c;
+}
+
+/* sigmoid_vec_*: out[i] = sigmoid(x[i]) for the n values of x */
+static void sigmoid_vec_table(const float *x, float *out, int n)
+{
+	int i;
 
+	for (i = 0; i < n; ++i)
+		out[i] = sigmoid_table(x[i]);
+}
 
-/* contains: return 1 if value is inside array. 0 otherwise. */
-int contains(int *array, int value, int size)
+static void sigmoid_vec_fine(const float *x, float *out, int n)
 {
-	int j;
+	int i;
 
-	for (j = 0; j < size; ++j)
-		if (array[j] == value)
-			return 1;
-	return 0;
+	for (i = 0; i < n; ++i)
+		out[i] = sigmoid_fine(x[i]);
 }
 
-/* shuffle: arrange the elements of array in random order. Swap two random cells
- * N times (N is the size of array).
- */
-void shuffle(int *array, int size)
+static void sigmoid_vec_rational(const float *x, float *out, int n)
 {
-	int i, j, tmp;
+	int i;
 
-	for (i = 0; i < size - 1; ++i)
-	{
-		j = i + rand() / (RAND_MAX / (size - i) + 1);
-		tmp = array[j];
-		array[j] = array[i];
-		array[i] = tmp;
-	}
+	for (i = 0; i < n; ++i)
+		out[i] = sigmoid_rational(x[i]);
 }
 
-/* init_negative_table: initialize the negative table used for negative
- * sampling. The table is composed of indexes of words, each one proportional
- * to the number of occurrence of this word.
- */
-void init_negative_table()
+static const struct sigmoids all_sigmoids[] = {
+	{ "table",    sigmoid_table,    sigmoid_vec_table    },
+	{ "fine",     sigmoid_fine,     sigmoid_vec_fine     },
+	{ "rational", sigmoid_rational, sigmoid_vec_rational },
+};
+
+struct sigmoids sig;
+
+static inline float sigmoid(const float x)
 {
-	int i, n_cells, pos;
-	float sum, d;
+	return sig.one(x);
+}
 
-	/* allocate memory for the negative table*/
-	table = calloc(table_size, sizeof *table);
+static inline void sigmoid_vec(const float *x, float *out, int n)
+{
+	sig.vec(x, out, n);
+}
 
-	if (table == NULL)
+/* init_sigmoid: select the sigmoid named name and generate its table */
+void init_sigmoid(char *name)
+{
+	int i, n = sizeof all_sigmoids / sizeof *all_sigmoids;
+	double x;
+
+	for (i = 0; i < n; ++i)
+		if ((name[0] == '\0' && i == 0) ||
+		    !strcmp(name, all_sigmoids[i].name))
+			break;
+	if (i == n)
 	{
-		printf("Cannot allocate memory for the negative table\n");
+		printf("ERROR: unknown -sigmoid value %s\n", name);
 		exit(1);
 	}
+	sig = all_sigmoids[i];
 
-	/* compute the sum of count^0.75 for all words */
-	for (i = 0, sum = 0.0; i < vocab_size; ++i)
-		sum += pow(vocab[i].count, 0.75);
-
-	/* multiply is faster than divide so precompute d = 1/sum */
-	for (i = 0, pos = 0, d = 1.0/sum; i < vocab_size; ++i)
+	/* each value is the sigmoid of the middle of its interval */
+	for (i = 0; i < FINE_SIZE; ++i)
 	{
-		/* compute number of cells reserved for word[i] */
-		n_cells = pow(vocab[i].count, 0.75) * table_size * d;
-
-		while (n_cells--)
-			table[pos++] = i;
+		x = -FINE_MAX + (i + 0.5) * (2.0 * FINE_MAX / FINE_SIZE);
+		fine_values[i] = 1.0 / (1.0 + exp(-x));
 	}
+}
 
-	/* due to rounding point error, it is possible that we inserted less
-	 * than table_size values. So update the table_size to the real size. */
-	table_size = pos-1;
+/* other variables */
+double start;            /* wall-clock time the training started */
+long start_words;        /* word_count_actual when it started */
+struct metrics metrics;
+int current_epoch = 0;
+long negsamp_rejected = 0;
+struct checkpoint ckpt = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+struct numa numa = { .n_nodes = 1 };
 
-	/* shuffle the array so we don't have to draw a new random index each
-	 * time we want a negative sample, simply keep a position_index, get the
-	 * table[position_index] value and increment position_index. This is the
-	 * same as drawing a new random index i and get table[i]. */
-	shuffle(table, table_size);
-}
 
-/* compute_discard_prob: compute the discard probabilty of each word. The
- * probability is defined as: p(w) = 1 - sqrt(t / f(w)) where t is the
- * threshold and f(w) is the frequency of word w. But we store
- * Y = sqrt(t / f(w)). Then we draw a random number X between 0 and 1 and
- * look if X > Y. X has a probability p(w) of being greater than Y.
- * If N is the total number of words, we have:
- *   Y = sqrt(t / ( count(w) / N )) = sqrt(t * N) / sqrt(count(w))
+/* contains: return 1 if value is inside the sorted array. 0 otherwise. Small
+ * arrays are scanned linearly, larger ones with a binary search.
  */
-void compute_discard_prob()
+static inline int contains(const int *array, int value, int size)
 {
-	int i;
-	float w;
+	int j, lo, hi;
 
-	/* precompute sqrt(t * n) */
-	w = sqrt(args.sample * train_words);
-	for (i = 0; i < vocab_size; ++i)
-		vocab[i].pdiscard = w / sqrt(vocab[i].count);
+	if (size <= PAIRS_LINEAR)
+	{
+		for (j = 0; j < size && array[j] <= value; ++j)
+			if (array[j] == value)
+				return 1;
+		return 0;
+	}
+
+	for (lo = 0, hi = size; lo < hi;)
+	{
+		j = lo + (hi - lo) / 2;
+		if (array[j] < value)
+			lo = j + 1;
+		else
+			hi = j;
+	}
+	return lo < size && array[lo] == value;
 }
 
-/* hash: form hash value for string s */
-unsigned int hash(char *s)
+/* set_slot: first cell to look at for value in a hash set of size cells */
+static inline long set_slot(int value, long size)
 {
-	unsigned int hashval;
-
-	for (hashval = 0; *s != '\0'; ++s)
-		hashval = hashval * 257 + *s;
-	return hashval % HASHSIZE;
+	unsigned int h = value * 0x9E3779B1U;
+	return (h ^ (h >> 16)) & (size - 1);
 }
 
-/* find: return the position of string s in vocab_hash. If word has never been
- * met, the cell at index hash(word) in vocab_hash will be -1. If the cell is
- * not -1, we start to compare word to each element with the same hash.
+/* has_pair: return 1 if target is a neighbor of w in p. 0 otherwise. The
+ * fastest lookup is chosen from the number of neighbors of w.
  */
-unsigned int find(char *s)
+static inline int has_pair(const struct pairs *p, int w, int target)
 {
-	unsigned int h = hash(s);
+	long n = p->offsets[w+1] - p->offsets[w], size, h;
+	const int *set;
 
-	while (vocab_hash[h] != -1 && strcmp(s, vocab[vocab_hash[h]].word))
-		h = (h + 1) % HASHSIZE;
-	return h;
+	if (n <= PAIRS_HASHED)
+		return contains(p->neighbors + p->offsets[w], target, n);
+
+	set  = p->sets + p->set_offsets[w];
+	size = p->set_offsets[w+1] - p->set_offsets[w];
+	for (h = set_slot(target, size); set[h] != -1; h = (h + 1) & (size - 1))
+		if (set[h] == target)
+			return 1;
+	return 0;
 }
 
-/* add word to the vocabulary. If word already exists, increment its count */
-void add_word(char *word)
+/* The dot product and the updates of the training loop are done by one set of
+ * kernels chosen at startup from the instructions supported by the processor
+ * (or forced with -simd). Kernels accept any dimension and unaligned rows.
+ *
+ *   dot(a, b, n)                      return sum of a[k] * b[k]
+ *   backprop(hidden, wo, wi, g, n)    hidden[k] += g * wo[k] and then
+ *                                     wo[k] += g * wi[k], in one pass
+ *   axpy(y, x, a, n)                  y[k] += a * x[k]
+ */
+struct kernels
 {
-	unsigned int h = find(word);
-	if (vocab_hash[h] == -1)
-	{
-		/* create new entry */
-		struct entry e;
-		e.word = malloc(sizeof(char) * (strlen(word)+1));
-		strcpy(e.word, word);
-		e.count    = 1;
-		e.pdiscard = 1.0;
-		e.n_sp     = 0;
-		e.pos_sp   = 0;
-		e.n_wp     = 0;
-		e.pos_wp   = 0;
-		e.sp       = NULL;
-		e.wp       = NULL;
+	const char *name;
+	float (*dot)(const float *a, const float *b, int n);
+	void  (*backprop)(float *hidden, float *wo, const float *wi, float g,
+	                  int n);
+	void  (*axpy)(float *y, const float *x, float a, int n);
+};
 
-		/* add it to vocab and set its index in vocab_hash */
-		vocab[vocab_size] = e;
-		vocab_hash[h] = vocab_size++;
+static float dot_scalar(const float *a, const float *b, int n)
+{
+	float s = 0.0;
+	int k;
 
-		/* reallocate more space if needed */
-		if (vocab_size >= vocab_max_size)
-		{
-			vocab_max_size += 10000;
-			vocab = realloc(vocab, vocab_max_size * sizeof(struct entry));
-		}
-	}
-	else
+	for (k = 0; k < n; ++k)
+		s += a[k] * b[k];
+	return s;
+}
+
+static void backprop_scalar(float *hidden, float *wo, const float *wi,
+                            float g, int n)
+{
+	int k;
+
+	for (k = 0; k < n; ++k)
 	{
-		vocab[vocab_hash[h]].count++;
+		hidden[k] += g * wo[k];
+		wo[k]     += g * wi[k];
 	}
 }
 
-/* compare_words: used to sort two words */
-int compare_words(const void *a, const void *b)
+static void axpy_scalar(float *y, const float *x, float a, int n)
 {
-	return ((struct entry *)b)->count - ((struct entry *)a)->count;
+	int k;
+
+	for (k = 0; k < n; ++k)
+		y[k] += a * x[k];
 }
 
-/* destroy_vocab: free all memory used to create stong/weak pairs arrays, free
- * memory used to store words (char *) and free the entire array of entries.
- */
-void destroy_vocab()
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, int n)
 {
-	int i;
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	float r[4];
+	int k;
 
-	for (i = 0; i < vocab_size; ++i)
+	for (k = 0; k + 8 <= n; k += 8)
 	{
-		free(vocab[i].word);
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + k),
+		                               _mm_loadu_ps(b + k)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + k + 4),
+		                               _mm_loadu_ps(b + k + 4)));
+	}
+	for (; k + 4 <= n; k += 4)
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + k),
+		                               _mm_loadu_ps(b + k)));
+
+	_mm_storeu_ps(r, _mm_add_ps(s0, s1));
+	r[0] += r[1] + r[2] + r[3];
+	for (; k < n; ++k)
+		r[0] += a[k] * b[k];
+	return r[0];
+}
 
-		if (vocab[i].sp != NULL)
-			free(vocab[i].sp);
+__attribute__((target("sse2")))
+static void backprop_sse2(float *hidden, float *wo, const float *wi, float g,
+                          int n)
+{
+	__m128 vg = _mm_set1_ps(g), o;
+	int k;
 
-		if (vocab[i].wp != NULL)
-			free(vocab[i].wp);
+	for (k = 0; k + 4 <= n; k += 4)
+	{
+		o = _mm_loadu_ps(wo + k);
+		_mm_storeu_ps(hidden + k, _mm_add_ps(_mm_loadu_ps(hidden + k),
+		                                     _mm_mul_ps(vg, o)));
+		_mm_storeu_ps(wo + k, _mm_add_ps(o, _mm_mul_ps(vg,
+		                                 _mm_loadu_ps(wi + k))));
+	}
+	for (; k < n; ++k)
+	{
+		hidden[k] += g * wo[k];
+		wo[k]     += g * wi[k];
 	}
-
-	free(vocab);
 }
 
-/* sort_and_reduce_vocab: sort the words in vocabulary by their number of
- * occurrences. Remove all words with less than min_count occurrences.
- */
-void sort_and_reduce_vocab()
+__attribute__((target("sse2")))
+static void axpy_sse2(float *y, const float *x, float a, int n)
 {
-	int i, valid_words;
+	__m128 va = _mm_set1_ps(a);
+	int k;
+
+	for (k = 0; k + 4 <= n; k += 4)
+		_mm_storeu_ps(y + k, _mm_add_ps(_mm_loadu_ps(y + k),
+		                     _mm_mul_ps(va, _mm_loadu_ps(x + k))));
+	for (; k < n; ++k)
+		y[k] += a * x[k];
+}
 
-	/* sort vocab in descending order by number of word occurrence */
-	qsort(vocab, vocab_size, sizeof(struct entry), compare_words);
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	__m128 s;
+	float r;
+	int k;
 
-	/* get the number of valid words (words with count >= min_count) */
-	valid_words = 0;
-	while (vocab[valid_words++].count >= args.min_count)
-		continue;
+	for (k = 0; k + 16 <= n; k += 16)
+	{
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k),
+		                     _mm256_loadu_ps(b + k), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8),
+		                     _mm256_loadu_ps(b + k + 8), s1);
+	}
+	for (; k + 8 <= n; k += 8)
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k),
+		                     _mm256_loadu_ps(b + k), s0);
+
+	s0 = _mm256_add_ps(s0, s1);
+	s  = _mm_add_ps(_mm256_castps256_ps128(s0),
+	                _mm256_extractf128_ps(s0, 1));
+	s  = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s  = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	r  = _mm_cvtss_f32(s);
+	for (; k < n; ++k)
+		r += a[k] * b[k];
+	return r;
+}
 
-	/* because valid_words has been incremented after the condition has
-	 * been evaluated to false */
-	valid_words--;
+__attribute__((target("avx2,fma")))
+static void backprop_avx2(float *hidden, float *wo, const float *wi, float g,
+                          int n)
+{
+	__m256 vg = _mm256_set1_ps(g), o;
+	int k;
 
-	/* remove words with less than min_count occurrences. Strong and weak
-	 * pairs have not been added to vocab yet, so no need to free the
-	 * allocated memory of strong/weak pairs arrays. */
-	for (i = valid_words; i < vocab_size; ++i)
+	for (k = 0; k + 8 <= n; k += 8)
 	{
-		train_words -= vocab[i].count;
-		free(vocab[i].word);
-		vocab[i].word = NULL;
+		o = _mm256_loadu_ps(wo + k);
+		_mm256_storeu_ps(hidden + k, _mm256_fmadd_ps(vg, o,
+		                 _mm256_loadu_ps(hidden + k)));
+		_mm256_storeu_ps(wo + k, _mm256_fmadd_ps(vg,
+		                 _mm256_loadu_ps(wi + k), o));
+	}
+	for (; k < n; ++k)
+	{
+		hidden[k] += g * wo[k];
+		wo[k]     += g * wi[k];
 	}
+}
 
-	/* resize the vocab array with its new size */
-	vocab_size = valid_words;
-	vocab = realloc(vocab, vocab_size * sizeof(struct entry));
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float *y, const float *x, float a, int n)
+{
+	__m256 va = _mm256_set1_ps(a);
+	int k;
+
+	for (k = 0; k + 8 <= n; k += 8)
+		_mm256_storeu_ps(y + k, _mm256_fmadd_ps(va,
+		                 _mm256_loadu_ps(x + k), _mm256_loadu_ps(y + k)));
+	for (; k < n; ++k)
+		y[k] += a * x[k];
+}
 
-	/* sorting has changed the index of each word, so update the value
-	 in vocab_hash. Start by reseting all values to -1.*/
-	for (i = 0; i < HASHSIZE; ++i)
-		vocab_hash[i] = -1;
-	for (i = 0; i < vocab_size; ++i)
-		vocab_hash[find(vocab[i].word)] = i;
+/* AVX-512 kernels handle the remainder with masked loads and stores */
+__attribute__((target("avx512f")))
+static float dot_avx512(const float *a, const float *b, int n)
+{
+	__m512 s = _mm512_setzero_ps();
+	__mmask16 m;
+	int k;
+
+	for (k = 0; k + 16 <= n; k += 16)
+		s = _mm512_fmadd_ps(_mm512_loadu_ps(a + k),
+		                    _mm512_loadu_ps(b + k), s);
+	if (k < n)
+	{
+		m = (__mmask16) ((1U << (n - k)) - 1);
+		s = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + k),
+		                    _mm512_maskz_loadu_ps(m, b + k), s);
+	}
+	return _mm512_reduce_add_ps(s);
 }
 
-/* read_strong_pairs; read the file containing the strong pairs. For each pair,
- * add it in the vocab for both words involved.
- */
-int read_strong_pairs(char *filename)
+__attribute__((target("avx512f")))
+static void backprop_avx512(float *hidden, float *wo, const float *wi, float g,
+                            int n)
 {
-	FILE *fi;
-	char word1[MAXLEN], word2[MAXLEN];
-	int i1, i2, len;
+	__m512 vg = _mm512_set1_ps(g), o;
+	__mmask16 m;
+	int k;
 
-	if ((fi = fopen(filename, "r")) == NULL)
+	for (k = 0; k + 16 <= n; k += 16)
 	{
-		printf("WARNING: strong pairs data not found!\n"
-		       "Not taken into account during learning.\n");
-		return 1;
+		o = _mm512_loadu_ps(wo + k);
+		_mm512_storeu_ps(hidden + k, _mm512_fmadd_ps(vg, o,
+		                 _mm512_loadu_ps(hidden + k)));
+		_mm512_storeu_ps(wo + k, _mm512_fmadd_ps(vg,
+		                 _mm512_loadu_ps(wi + k), o));
 	}
-
-	while ((fscanf(fi, "%s %s", word1, word2) != EOF))
+	if (k < n)
 	{
-		i1 = find(word1);
-		i2 = find(word2);
+		m = (__mmask16) ((1U << (n - k)) - 1);
+		o = _mm512_maskz_loadu_ps(m, wo + k);
+		_mm512_mask_storeu_ps(hidden + k, m, _mm512_fmadd_ps(vg, o,
+		                      _mm512_maskz_loadu_ps(m, hidden + k)));
+		_mm512_mask_storeu_ps(wo + k, m, _mm512_fmadd_ps(vg,
+		                      _mm512_maskz_loadu_ps(m, wi + k), o));
+	}
+}
 
-		/* nothing to do if one of the word is not in vocab */
-		if (vocab_hash[i1] == -1 || vocab_hash[i2] == -1)
-			continue;
+__attribute__((target("avx512f")))
+static void axpy_avx512(float *y, const float *x, float a, int n)
+{
+	__m512 va = _mm512_set1_ps(a);
+	__mmask16 m;
+	int k;
+
+	for (k = 0; k + 16 <= n; k += 16)
+		_mm512_storeu_ps(y + k, _mm512_fmadd_ps(va,
+		                 _mm512_loadu_ps(x + k), _mm512_loadu_ps(y + k)));
+	if (k < n)
+	{
+		m = (__mmask16) ((1U << (n - k)) - 1);
+		_mm512_mask_storeu_ps(y + k, m, _mm512_fmadd_ps(va,
+		                      _mm512_maskz_loadu_ps(m, x + k),
+		                      _mm512_maskz_loadu_ps(m, y + k)));
+	}
+}
+#endif
+
+/* all kernels, from the most to the least efficient one */
+static const struct kernels all_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+	{ "avx512", dot_avx512, backprop_avx512, axpy_avx512 },
+	{ "avx2",   dot_avx2,   backprop_avx2,   axpy_avx2   },
+	{ "sse2",   dot_sse2,   backprop_sse2,   axpy_sse2   },
+#endif
+	{ "scalar", dot_scalar, backprop_scalar, axpy_scalar },
+};
 
-		/* get the real indexes (not the index in the hash table) */
-		i1 = vocab_hash[i1];
-		i2 = vocab_hash[i2];
+struct kernels kern;
 
-		/* look if we already have added one strong pair for i1. If not,
-		 * create the array. Else, expand by one cell. */
-		len = vocab[i1].n_sp;
-		if (len == 0)
-			vocab[i1].sp = calloc(1, sizeof(int));
-		else
-			vocab[i1].sp = realloc(vocab[i1].sp, (len+1) * sizeof(int));
+/* kernels_supported: return 1 if the processor can run kernels k */
+int kernels_supported(const struct kernels *k)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (!strcmp(k->name, "avx512"))
+		return __builtin_cpu_supports("avx512f");
+	if (!strcmp(k->name, "avx2"))
+		return __builtin_cpu_supports("avx2") &&
+		       __builtin_cpu_supports("fma");
+	if (!strcmp(k->name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
 
-		/* add i2 to the list of strong pairs indexes of word1 */
-		vocab[i1].sp[len] = i2;
-		vocab[i1].n_sp++;
+/* init_kernels: select the kernels named name, or the most efficient ones
+ * supported by the processor if name is empty or "auto".
+ */
+void init_kernels(char *name)
+{
+	int i, n = sizeof all_kernels / sizeof all_kernels[0];
+	int automatic = (name[0] == '\0' || !strcmp(name, "auto"));
 
-		/*   ---------   */
+	for (i = 0; i < n; ++i)
+	{
+		if (!automatic && strcmp(name, all_kernels[i].name))
+			continue;
 
-		/* look if we already have added one pair for i2. If not, create
-		 the array. Else, expand by one cell. */
-		len = vocab[i2].n_sp;
-		if (len == 0)
-			vocab[i2].sp = calloc(1, sizeof(int));
-		else
-			vocab[i2].sp = realloc(vocab[i2].sp, (len+1) * sizeof(int));
+		if (!kernels_supported(&all_kernels[i]))
+		{
+			if (automatic)
+				continue;
+			printf("ERROR: %s is not supported by this processor\n",
+			       name);
+			exit(1);
+		}
 
-		/* add i2 to the list of strong pairs indexes of word1 */
-		vocab[i2].sp[len] = i1;
-		vocab[i2].n_sp++;
+		kern = all_kernels[i];
+		return;
 	}
 
-	fclose(fi);
-	return 0;
+	printf("ERROR: unknown -simd value %s\n", name);
+	exit(1);
 }
 
-/* read_weak_pairs: read the file containing the weak pairs. For each pair, add
- * it in the vocab for both words involved.
- */
-int read_weak_pairs(char *filename)
+/* parse_cpulist: add the CPUs of a sysfs list like "0-3,8-11" to set */
+void parse_cpulist(char *s, cpu_set_t *set)
 {
-	FILE *fi;
-	char word1[MAXLEN], word2[MAXLEN];
-	int i1, i2, len;
+	long first, last, c;
+	char *end;
 
-	if ((fi = fopen(filename, "r")) == NULL)
+	while (*s >= '0' && *s <= '9')
 	{
-		printf("WARNING: weak pairs data not found!\n"
-		       "Not taken into account during learning.\n");
-		return 1;
+		first = last = strtol(s, &end, 10);
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (c = first; c <= last && c < CPU_SETSIZE; ++c)
+			CPU_SET(c, set);
+		s = (*end == ',') ? end + 1 : end;
 	}
+}
+
+/* init_numa: find the NUMA nodes and their CPUs usable by the process. Keep
+ * a single node if -numa is off or the nodes cannot be read. */
+void init_numa()
+{
+	char path[64], list[4096];
+	cpu_set_t allowed, cpus;
+	FILE *f;
+	int node;
+
+	numa.n_nodes = 1;
+	if (!args.numa || sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+		return;
 
-	while ((fscanf(fi, "%s %s", word1, word2) != EOF))
+	numa.n_nodes = 0;
+	for (node = 0; node < MAX_NODES; ++node)
 	{
-		i1 = find(word1);
-		i2 = find(word2);
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		numa.mask |= 1UL << node;
 
-		/* nothing to do if one of the word is not in vocab */
-		if (vocab_hash[i1] == -1 || vocab_hash[i2] == -1)
+		CPU_ZERO(&cpus);
+		if (fgets(list, sizeof list, f) != NULL)
+			parse_cpulist(list, &cpus);
+		fclose(f);
+
+		/* nodes without usable CPUs only hold memory */
+		CPU_AND(&cpus, &cpus, &allowed);
+		if (CPU_COUNT(&cpus) == 0)
 			continue;
+		numa.ids[numa.n_nodes]    = node;
+		numa.cpus[numa.n_nodes++] = cpus;
+	}
 
-		/* get the real indexes (not the index in the hash table) */
-		i1 = vocab_hash[i1];
-		i2 = vocab_hash[i2];
+	if (numa.n_nodes == 0)
+	{
+		printf("WARNING: cannot read NUMA nodes, -numa ignored\n");
+		numa.n_nodes = 1;
+		numa.mask    = 0;
+		return;
+	}
 
-		/* look if we already have added one pair for i1. If not, create
-		the array. Else, expand by one cell. */
-		len = vocab[i1].n_wp;
-		if (len == 0)
-			vocab[i1].wp = calloc(1, sizeof(int));
-		else
-			vocab[i1].wp = realloc(vocab[i1].wp, (len+1) * sizeof(int));
+	printf("NUMA nodes: %d\n", numa.n_nodes);
+}
 
-		/* add i2 to the list of weak pairs indexes of word1 */
-		vocab[i1].wp[len] = i2;
-		vocab[i1].n_wp++;
+/* numa_interleave: interleave the pages of [p, p+size) over all nodes. Must
+ * be called before the pages are touched. */
+void numa_interleave(void *p, long size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = ((uintptr_t) p + page - 1) / page * page,
+	          last  = ((uintptr_t) p + size) / page * page;
+
+	/* 3 is MPOL_INTERLEAVE */
+	if (numa.mask == 0 || (numa.mask & (numa.mask - 1)) == 0 || last <= first)
+		return;
+	if (syscall(SYS_mbind, first, last - first, 3, &numa.mask,
+	            8 * sizeof numa.mask, 0) != 0)
+		printf("WARNING: cannot interleave memory over NUMA nodes\n");
+}
 
-		/*   ---------   */
+/* node_of_thread: node on which thread i runs, threads are given to the
+ * nodes by blocks */
+int node_of_thread(int i)
+{
+	return (long) i * numa.n_nodes / args.num_threads;
+}
 
-		/* look if we already have added one pair for i2. If not, create
-		 the array. Else, expand by one cell. */
-		len = vocab[i2].n_wp;
-		if (len == 0)
-			vocab[i2].wp = calloc(1, sizeof(int));
-		else
-			vocab[i2].wp = realloc(vocab[i2].wp, (len+1) * sizeof(int));
+/* wall_time: seconds elapsed on a monotonic clock */
+double wall_time()
+{
+	struct timespec t;
 
-		/* add i1 to the list of weak pairs indexes of word2 */
-		vocab[i2].wp[len] = i1;
-		vocab[i2].n_wp++;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* open_metrics: connect to the socket or open the file filename */
+FILE *open_metrics(char *filename)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (stat(filename, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return fopen(filename, "a");
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, filename, sizeof addr.sun_path - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return NULL;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+	{
+		close(fd);
+		return NULL;
 	}
 
-	fclose(fi);
-	return 0;
+	/* a dashboard going away must not stop the training */
+	signal(SIGPIPE, SIG_IGN);
+	return fdopen(fd, "w");
 }
 
-/* read_vocab: read the file given as -input. For each word, either add it in
- * the vocab or increment its occurrence. Also read the strong and weak pairs
+/* init_metrics: allocate the counters and open the -metrics output */
+void init_metrics()
+{
+	metrics.begin      = wall_time();
+	metrics.threads    = aligned_alloc(64, args.num_threads *
+	                                   sizeof *metrics.threads);
+	metrics.words      = calloc(args.num_threads, sizeof *metrics.words);
+	metrics.last_words = calloc(args.num_threads,
+	                            sizeof *metrics.last_words);
+	if (metrics.threads == NULL || metrics.words == NULL ||
+	    metrics.last_words == NULL)
+	{
+		printf("Cannot allocate memory for metrics\n");
+		exit(1);
+	}
+	memset(metrics.threads, 0, args.num_threads * sizeof *metrics.threads);
+
+	if (args.metrics[0] != '\0' &&
+	    (metrics.out = open_metrics(args.metrics)) == NULL)
+	{
+		printf("ERROR: cannot open metrics output %s\n", args.metrics);
+		exit(1);
+	}
+}
+
+/* destroy_metrics: close the -metrics output and free the counters */
+void destroy_metrics()
+{
+	if (metrics.out != NULL)
+		fclose(metrics.out);
+	free(metrics.threads);
+	free(metrics.words);
+	free(metrics.last_words);
+}
+
+/* end_phase: write the duration of phase, which began at since */
+void end_phase(int phase, double since)
+{
+	static const char *names[N_PHASES] = {
+		"vocab", "pairs", "init", "train", "save"
+	};
+	double now = wall_time();
+
+	if (metrics.out == NULL)
+		return;
+	fprintf(metrics.out, "{\"type\":\"phase\",\"time\":%.3f,"
+	        "\"phase\":\"%s\",\"seconds\":%.3f}\n",
+	        now - metrics.begin, names[phase], now - since);
+	fflush(metrics.out);
+}
+
+/* publish_counters: store the counters of a thread, base being their values
+ * when its epoch started */
+static inline void publish_counters(struct counters *c,
+                                    const struct counters *base, long words,
+                                    long negatives, long discarded,
+                                    long pair_draws)
+{
+	__atomic_store_n(&c->words, base->words + words, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->negatives, base->negatives + negatives,
+	                 __ATOMIC_RELAXED);
+	__atomic_store_n(&c->discarded, base->discarded + discarded,
+	                 __ATOMIC_RELAXED);
+	__atomic_store_n(&c->pair_draws, base->pair_draws + pair_draws,
+	                 __ATOMIC_RELAXED);
+}
+
+/* write_progress: write a progress line of the counters of all threads */
+void write_progress()
+{
+	long words = 0, delta = 0, negatives = 0, discarded = 0, pair_draws = 0;
+	double now = wall_time(), dt, progress;
+	float alpha;
+	int i;
+
+	if (metrics.out == NULL)
+		return;
+
+	dt = (now > metrics.last) ? now - metrics.last : 1e-9;
+	for (i = 0; i < args.num_threads; ++i)
+	{
+		metrics.words[i] = __atomic_load_n(&metrics.threads[i].words,
+		                                   __ATOMIC_RELAXED);
+		words      += metrics.words[i];
+		delta      += metrics.words[i] - metrics.last_words[i];
+		negatives  += __atomic_load_n(&metrics.threads[i].negatives,
+		                              __ATOMIC_RELAXED);
+		discarded  += __atomic_load_n(&metrics.threads[i].discarded,
+		                              __ATOMIC_RELAXED);
+		pair_draws += __atomic_load_n(&metrics.threads[i].pair_draws,
+		                              __ATOMIC_RELAXED);
+	}
+	__atomic_load(&args.alpha, &alpha, __ATOMIC_RELAXED);
+	progress = __atomic_load_n(&word_count_actual, __ATOMIC_RELAXED) *
+	           100.0 / ((double) args.epoch * train_words);
+
+	fprintf(metrics.out, "{\"type\":\"progress\",\"time\":%.3f,"
+	        "\"epoch\":%d,\"progress\":%.4f,\"alpha\":%g,"
+	        "\"words\":%ld,\"words_per_sec\":%.1f,\"negatives\":%ld,"
+	        "\"discarded\":%ld,\"discard_rate\":%.6f,"
+	        "\"pair_draws\":%ld,\"threads\":[",
+	        now - metrics.begin, current_epoch + 1, progress, alpha, words,
+	        delta / dt, negatives, discarded,
+	        (negatives + discarded > 0) ?
+	        (double) discarded / (negatives + discarded) : 0.0,
+	        pair_draws);
+	for (i = 0; i < args.num_threads; ++i)
+	{
+		fprintf(metrics.out, "%s{\"words\":%ld,\"words_per_sec\":%.1f}",
+		        i ? "," : "", metrics.words[i],
+		        (metrics.words[i] - metrics.last_words[i]) / dt);
+		metrics.last_words[i] = metrics.words[i];
+	}
+	fprintf(metrics.out, "]}\n");
+	fflush(metrics.out);
+	metrics.last = now;
+}
+
+/* init_negative_table: initialize the alias table used for negative sampling.
+ * Word i is drawn with a probability proportional to count(i)^neg_power.
+ * The table is built in O(vocab_size) with the algorithm of Vose: cells
+ * with less than the average weight are filled up with the excess of cells
+ * with more than the average.
+ */
+void init_negative_table()
+{
+	double *p, sum;
+	long *small, *large, n_small, n_large, i, s, l;
+
+	table = malloc(vocab_size * sizeof *table);
+	p     = malloc(vocab_size * sizeof *p);
+	small = malloc(vocab_size * sizeof *small);
+	large = malloc(vocab_size * sizeof *large);
+
+	if (table == NULL || p == NULL || small == NULL || large == NULL)
+	{
+		printf("Cannot allocate memory for the negative table\n");
+		exit(1);
+	}
+	numa_interleave(table, vocab_size * sizeof *table);
+
+	/* compute the sum of count^neg_power for all words */
+	for (i = 0, sum = 0.0; i < vocab_size; ++i)
+		sum += (p[i] = pow(vocab[i].count, args.neg_power));
+
+	/* scale weights so the average weight is 1 */
+	for (i = 0, n_small = n_large = 0; i < vocab_size; ++i)
+	{
+		p[i] *= vocab_size / sum;
+		if (p[i] < 1.0)
+			small[n_small++] = i;
+		else
+			large[n_large++] = i;
+	}
+
+	while (n_small > 0 && n_large > 0)
+	{
+		s = small[--n_small];
+		l = large[n_large - 1];
+
+		table[s].prob  = p[s];
+		table[s].alias = l;
+
+		/* l gave 1 - p[s] of its weight to cell s */
+		p[l] -= 1.0 - p[s];
+		if (p[l] < 1.0)
+		{
+			--n_large;
+			small[n_small++] = l;
+		}
+	}
+
+	/* remaining cells are full, up to rounding errors */
+	while (n_large > 0)
+	{
+		l = large[--n_large];
+		table[l].prob  = 1.0;
+		table[l].alias = l;
+	}
+	while (n_small > 0)
+	{
+		s = small[--n_small];
+		table[s].prob  = 1.0;
+		table[s].alias = s;
+	}
+
+	free(large);
+	free(small);
+	free(p);
+}
+
+/* compute_discard_prob: compute the discard probabilty of each word. The
+ * probability is defined as: p(w) = 1 - sqrt(t / f(w)) where t is the
+ * threshold and f(w) is the frequency of word w. But we store
+ * Y = sqrt(t / f(w)). Then we draw a random number X between 0 and 1 and
+ * look if X > Y. X has a probability p(w) of being greater than Y.
+ * If N is the total number of words, we have:
+ *   Y = sqrt(t / ( count(w) / N )) = sqrt(t * N) / sqrt(count(w))
+ */
+void compute_discard_prob()
+{
+	int i;
+	float w;
+
+	free(pdiscard);
+	if ((pdiscard = malloc((vocab_size + 1) * sizeof *pdiscard)) == NULL)
+	{
+		printf("Cannot allocate memory for the discard probabilities\n");
+		exit(1);
+	}
+
+	/* precompute sqrt(t * n). Without subsampling, all words are kept */
+	w = sqrt(args.sample * train_words);
+	for (i = 0; i < vocab_size; ++i)
+		pdiscard[i] = (args.sample > 0) ? w / sqrt(vocab[i].count) : 1.0;
+}
+
+/* map_file: map the whole file filename in memory (read-only) and set *size
+ * to its size. Return NULL if the file cannot be opened or mapped.
+ */
+char *map_file(char *filename, long *size)
+{
+	struct stat st;
+	char *data;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* the mapping stays valid after the file descriptor is closed */
+	close(fd);
+	return (data == MAP_FAILED) ? NULL : data;
+}
+
+/* open_corpus: map the whole input file in memory. The mapping is read-only
+ * and shared by all threads, so the page cache is not duplicated.
+ */
+void open_corpus(char *filename)
+{
+	if ((corpus.data = map_file(filename, &file_size)) == NULL)
+	{
+		printf("ERROR: training data file not found or empty!\n");
+		exit(1);
+	}
+
+	corpus.end = corpus.data + file_size;
+	madvise(corpus.data, file_size, MADV_SEQUENTIAL);
+}
+
+/* close_corpus: unmap the input file */
+void close_corpus()
+{
+	if (corpus.data != NULL)
+		munmap(corpus.data, corpus.end - corpus.data);
+	corpus.data = corpus.end = NULL;
+}
+
+/* is_space: same separators as the %s conversion of scanf in the C locale */
+static inline int is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* next_token: skip separators starting at *pos, then set *token to the first
+ * character of the next word and return its length. *pos is moved after the
+ * word. Return 0 if there are no more words before end. Words are not copied
+ * nor null-terminated. Like scanf("%99s"), words longer than MAXLEN-1 are
+ * split into several words.
+ */
+static inline int next_token(char **pos, char *end, char **token)
+{
+	char *p = *pos, *start, *max;
+
+	while (p < end && is_space(*p))
+		++p;
+
+	start = p;
+	max   = (end - p > MAXLEN - 1) ? p + MAXLEN - 1 : end;
+	while (p < max && !is_space(*p))
+		++p;
+
+	*token = start;
+	*pos   = p;
+	return p - start;
+}
+
+/* token_boundary: return the first position at or after p where next_token()
+ * would start a word if it had read the file from its beginning. If p is in
+ * the middle of a word, the rest of this word belongs to whoever reads the
+ * bytes before p.
+ */
+char *token_boundary(char *p)
+{
+	char *start, *chunk;
+
+	if (p <= corpus.data || p >= corpus.end || is_space(p[-1]))
+		return p;
+
+	/* find where the word containing p begins */
+	for (start = p; start > corpus.data && !is_space(start[-1]); --start)
+		continue;
+
+	/* words longer than MAXLEN-1 are split in chunks of MAXLEN-1
+	 * characters, so the next word might start inside this one */
+	chunk = start + (p - start + MAXLEN - 2) / (MAXLEN - 1) * (MAXLEN - 1);
+	while (p < chunk && p < corpus.end && !is_space(*p))
+		++p;
+	return p;
+}
+
+/* hash_string: 64 bits hash of the len first characters of s, mixed 8 bytes
+ * at a time. The low bits give the cell of a word in the hash tables, the
+ * high 32 bits its fingerprint.
+ */
+static inline uint64_t hash_string(const char *s, int len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL * (len + 1), k;
+
+	for (; len >= 8; s += 8, len -= 8)
+	{
+		memcpy(&k, s, 8);
+		h = (h ^ k) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+	}
+	if (len > 0)
+	{
+		for (k = 0; len--;)
+			k = (k << 8) | (unsigned char) s[len];
+		h = (h ^ k) * 0xBF58476D1CE4E5B9ULL;
+	}
+
+	h ^= h >> 29;
+	h *= 0x94D049BB133111EBULL;
+	return h ^ (h >> 32);
+}
+
+/* vocab_word: return the string of the word of index i */
+static inline char *vocab_word(long i)
+{
+	return strings.data + vocab[i].word;
+}
+
+/* find_hashed: return the cell of the len first characters of s, of hash hv,
+ * in vocab_hash. If word has never been met, it is the empty cell where it
+ * would be added. Only words with the same fingerprint are compared. s does
+ * not need to be null-terminated, so words can be looked up directly inside
+ * the mapped input file.
+ */
+static inline long find_hashed(const char *s, int len, uint64_t hv)
+{
+	uint32_t fp = hv >> 32;
+	long mask = vocab_hash_size - 1, h = hv & mask;
+	char *w;
+	int i;
+
+	for (; vocab_hash[h].index != -1; h = (h + 1) & mask)
+	{
+		if (vocab_hash[h].fingerprint != fp)
+			continue;
+
+		/* words are short, an inlined loop is faster than strncmp */
+		w = vocab_word(vocab_hash[h].index);
+		for (i = 0; i < len && s[i] == w[i]; ++i)
+			continue;
+		if (i == len && w[len] == '\0')
+			break;
+	}
+	return h;
+}
+
+/* find: return the cell of the len first characters of s in vocab_hash */
+long find(const char *s, int len)
+{
+	return find_hashed(s, len, hash_string(s, len));
+}
+
+/* search_vocab: return the index of the len first characters of s in vocab,
+ * or -1 if it is not in vocab */
+static inline int search_vocab(const char *s, int len)
+{
+	return vocab_hash[find(s, len)].index;
+}
+
+/* resize_vocab_hash: replace vocab_hash by an empty table for n words (at
+ * least twice as many cells) and add the words of vocab in it */
+void resize_vocab_hash(long n)
+{
+	uint64_t hv;
+	long i, h, len;
+
+	for (vocab_hash_size = 1024; vocab_hash_size < 2 * n;)
+		vocab_hash_size *= 2;
+
+	free(vocab_hash);
+	vocab_hash = malloc(vocab_hash_size * sizeof *vocab_hash);
+	if (vocab_hash == NULL)
+	{
+		printf("Cannot allocate memory for the vocabulary hash table\n");
+		exit(1);
+	}
+	memset(vocab_hash, -1, vocab_hash_size * sizeof *vocab_hash);
+
+	for (i = 0; i < vocab_size; ++i)
+	{
+		len = strlen(vocab_word(i));
+		hv  = hash_string(vocab_word(i), len);
+		h   = find_hashed(vocab_word(i), len, hv);
+		vocab_hash[h].fingerprint = hv >> 32;
+		vocab_hash[h].index       = i;
+	}
+}
+
+/* add word to the vocabulary with count occurrences. If word already exists,
+ * increment its count.
+ */
+void add_word(const char *word, int len, long count)
+{
+	uint64_t hv = hash_string(word, len);
+	long h = find_hashed(word, len, hv);
+
+	if (vocab_hash[h].index == -1)
+	{
+		struct entry e;
+
+		/* copy the string at the end of the arena */
+		if (strings.size + len + 1 > strings.capacity)
+		{
+			strings.capacity = 2 * (strings.size + len + 1);
+			if (strings.capacity < 1 << 20)
+				strings.capacity = 1 << 20;
+			strings.data = realloc(strings.data, strings.capacity);
+			if (strings.data == NULL)
+			{
+				printf("Cannot allocate memory for the words\n");
+				exit(1);
+			}
+		}
+		memcpy(strings.data + strings.size, word, len);
+		strings.data[strings.size + len] = '\0';
+
+		/* create new entry */
+		e.word  = strings.size;
+		e.count = count;
+		strings.size += len + 1;
+
+		/* add it to vocab and set its index in vocab_hash */
+		vocab[vocab_size] = e;
+		vocab_hash[h].fingerprint = hv >> 32;
+		vocab_hash[h].index       = vocab_size++;
+
+		/* keep the load factor under 1/2 */
+		if (vocab_size * 2 > vocab_hash_size)
+			resize_vocab_hash(vocab_size);
+
+		/* reallocate more space if needed */
+		if (vocab_size >= vocab_max_size)
+		{
+			vocab_max_size += 10000;
+			vocab = realloc(vocab, vocab_max_size * sizeof(struct entry));
+		}
+	}
+	else
+	{
+		vocab[vocab_hash[h].index].count += count;
+	}
+}
+
+/* compare_words: used to sort two words. Words are sorted by decreasing
+ * number of occurrences, then alphabetically so the order of the vocabulary
+ * does not depend on the number of threads used to build it.
+ */
+int compare_words(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	if (x->count != y->count)
+		return (x->count < y->count) ? 1 : -1;
+	return strcmp(strings.data + x->word, strings.data + y->word);
+}
+
+/* destroy_vocab: free all memory used to create stong/weak pairs arrays, free
+ * the arena of the words and the arrays of entries.
+ */
+void destroy_vocab()
+{
+	free(strings.data);
+	free(pdiscard);
+	free(strong.offsets);
+	free(strong.neighbors);
+	free(strong.set_offsets);
+	free(strong.sets);
+	free(weak.offsets);
+	free(weak.neighbors);
+	free(weak.set_offsets);
+	free(weak.sets);
+	free(paired);
+	free(vocab);
+}
+
+/* Each thread sorts one part of the vocabulary with qsort(). Sorted parts are
+ * then merged two by two, each merge being done by its own thread, until only
+ * one part remains.
+ */
+struct sort_job
+{
+	struct entry *src;   /* array containing the parts to sort/merge */
+	struct entry *dst;   /* where merged entries are written */
+	long begin, middle, end;
+};
+
+/* sort_thread: sort the entries src[begin..end) */
+void *sort_thread(void *arg)
+{
+	struct sort_job *job = arg;
+
+	qsort(job->src + job->begin, job->end - job->begin,
+	      sizeof(struct entry), compare_words);
+	return NULL;
+}
+
+/* merge_thread: merge the sorted src[begin..middle) and src[middle..end)
+ * into dst[begin..end) */
+void *merge_thread(void *arg)
+{
+	struct sort_job *job = arg;
+	struct entry *src = job->src, *dst = job->dst + job->begin;
+	long i = job->begin, j = job->middle;
+
+	while (i < job->middle && j < job->end)
+	{
+		if (compare_words(src + j, src + i) < 0)
+			*dst++ = src[j++];
+		else
+			*dst++ = src[i++];
+	}
+	while (i < job->middle)
+		*dst++ = src[i++];
+	while (j < job->end)
+		*dst++ = src[j++];
+	return NULL;
+}
+
+/* parallel_sort_vocab: sort the vocabulary in num_threads parts at the same
+ * time, then merge them.
+ */
+void parallel_sort_vocab(int num_threads)
+{
+	struct sort_job *jobs;
+	struct entry *buffer, *tmp;
+	pthread_t *threads;
+	long *bounds;
+	int i, n, parts;
+
+	if (num_threads < 1 || vocab_size < 2 * num_threads)
+		num_threads = 1;
+
+	jobs    = calloc(num_threads, sizeof *jobs);
+	threads = calloc(num_threads, sizeof *threads);
+	bounds  = calloc(num_threads + 1, sizeof *bounds);
+	buffer  = malloc(vocab_size * sizeof *buffer);
+	if (!jobs || !threads || !bounds || !buffer)
+	{
+		printf("Cannot allocate memory to sort the vocabulary\n");
+		exit(1);
+	}
+
+	for (i = 0; i <= num_threads; ++i)
+		bounds[i] = vocab_size * i / num_threads;
+
+	for (i = 0; i < num_threads; ++i)
+	{
+		jobs[i].src   = vocab;
+		jobs[i].begin = bounds[i];
+		jobs[i].end   = bounds[i+1];
+		pthread_create(&threads[i], NULL, sort_thread, &jobs[i]);
+	}
+	for (i = 0; i < num_threads; ++i)
+		pthread_join(threads[i], NULL);
+
+	/* merge parts two by two. When the number of parts is odd, the last
+	 * one is only copied into the destination array. */
+	for (parts = num_threads; parts > 1; parts = (parts + 1) / 2)
+	{
+		for (i = 0, n = 0; i < parts; i += 2, ++n)
+		{
+			jobs[n].src    = vocab;
+			jobs[n].dst    = buffer;
+			jobs[n].begin  = bounds[i];
+			jobs[n].middle = bounds[i+1];
+			jobs[n].end    = (i + 1 < parts) ? bounds[i+2] : bounds[i+1];
+			pthread_create(&threads[n], NULL, merge_thread, &jobs[n]);
+		}
+		for (i = 0; i < n; ++i)
+			pthread_join(threads[i], NULL);
+
+		/* parts i and i+1 are now a single part */
+		for (i = 0; i < n; ++i)
+			bounds[i+1] = jobs[i].end;
+
+		tmp    = vocab;
+		vocab  = buffer;
+		buffer = tmp;
+	}
+
+	free(buffer);
+	free(bounds);
+	free(threads);
+	free(jobs);
+}
+
+/* pack_strings: copy the strings of the words in a new arena, in the order
+ * of vocab, without the strings of removed words */
+void pack_strings()
+{
+	struct arena packed;
+	long i, len;
+
+	for (i = 0, packed.capacity = 1; i < vocab_size; ++i)
+		packed.capacity += strlen(vocab_word(i)) + 1;
+	if ((packed.data = malloc(packed.capacity)) == NULL)
+	{
+		printf("Cannot allocate memory for the words\n");
+		exit(1);
+	}
+
+	for (i = 0, packed.size = 0; i < vocab_size; ++i)
+	{
+		len = strlen(vocab_word(i)) + 1;
+		memcpy(packed.data + packed.size, vocab_word(i), len);
+		vocab[i].word = packed.size;
+		packed.size  += len;
+	}
+
+	free(strings.data);
+	strings = packed;
+}
+
+/* sort_and_reduce_vocab: sort the words in vocabulary by their number of
+ * occurrences. Remove all words with less than min_count occurrences.
+ */
+void sort_and_reduce_vocab()
+{
+	int i, valid_words;
+
+	/* remove words with less than min_count occurrences before sorting,
+	 * most of the words in vocabulary only appear a few times. Strong and
+	 * weak pairs have not been added to vocab yet, so no need to free the
+	 * allocated memory of strong/weak pairs arrays. */
+	for (i = 0, valid_words = 0; i < vocab_size; ++i)
+	{
+		if (vocab[i].count >= args.min_count)
+		{
+			vocab[valid_words++] = vocab[i];
+			continue;
+		}
+
+		train_words -= vocab[i].count;
+	}
+
+	/* resize the vocab array with its new size */
+	vocab_size = valid_words;
+	vocab = realloc(vocab, (vocab_size + 1) * sizeof(struct entry));
+
+	/* sort vocab in descending order by number of word occurrence */
+	parallel_sort_vocab(args.num_threads);
+	pack_strings();
+
+	/* sorting has changed the index of each word, so rebuild vocab_hash,
+	 at the size of the final vocabulary */
+	resize_vocab_hash(vocab_size);
+}
+
+/* Pairs files are loaded in parallel. Each thread parses the lines starting
+ * in its part of the mapped file and keeps the pairs of indexes it found.
+ * The number of pairs of each word is counted with atomic increments, which
+ * gives the offsets of the CSR layout. Threads then copy their pairs at
+ * their place, and each neighbor list is sorted and deduplicated.
+ */
+struct pairs_job
+{
+	char *begin, *end;   /* part of the pairs file to parse */
+	int  *found;         /* pairs of indexes found in this part */
+	long n_found;
+	long first, last;    /* words whose neighbor lists are sorted */
+	long *count;         /* shared number of neighbors of each word */
+	struct pairs *p;
+};
+
+/* compare_ints: used to sort neighbor lists */
+int compare_ints(const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+/* parse_pairs_thread: find the indexes of both words of each line of the part
+ * [begin, end) and count them as neighbors of each other.
+ */
+void *parse_pairs_thread(void *arg)
+{
+	struct pairs_job *job = arg;
+	char *cur, *eol, *w1, *w2;
+	int len1, len2, i1, i2;
+	long capacity = 1024;
+
+	job->n_found = 0;
+	if ((job->found = malloc(capacity * 2 * sizeof *job->found)) == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+
+	for (cur = job->begin; cur < job->end; cur = eol + 1)
+	{
+		if ((eol = memchr(cur, '\n', job->end - cur)) == NULL)
+			eol = job->end;
+
+		if ((len1 = next_token(&cur, eol, &w1)) == 0 ||
+		    (len2 = next_token(&cur, eol, &w2)) == 0)
+			continue;
+
+		/* nothing to do if one of the word is not in vocab */
+		if ((i1 = search_vocab(w1, len1)) == -1 ||
+		    (i2 = search_vocab(w2, len2)) == -1)
+			continue;
+
+		if (job->n_found == capacity)
+		{
+			capacity *= 2;
+			job->found = realloc(job->found,
+			                     capacity * 2 * sizeof *job->found);
+			if (job->found == NULL)
+			{
+				printf("Cannot allocate memory for pairs\n");
+				exit(1);
+			}
+		}
+
+		job->found[2 * job->n_found]     = i1;
+		job->found[2 * job->n_found + 1] = i2;
+		job->n_found++;
+
+		__atomic_add_fetch(&job->count[i1], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&job->count[i2], 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* fill_pairs_thread: copy the pairs found by this thread at their place in
+ * the neighbor lists. job->count[i] is the next free cell of word i.
+ */
+void *fill_pairs_thread(void *arg)
+{
+	struct pairs_job *job = arg;
+	int *neighbors = job->p->neighbors, i1, i2;
+	long i;
+
+	for (i = 0; i < job->n_found; ++i)
+	{
+		i1 = job->found[2 * i];
+		i2 = job->found[2 * i + 1];
+		neighbors[__atomic_fetch_add(&job->count[i1], 1,
+		          __ATOMIC_RELAXED)] = i2;
+		neighbors[__atomic_fetch_add(&job->count[i2], 1,
+		          __ATOMIC_RELAXED)] = i1;
+	}
+
+	free(job->found);
+	return NULL;
+}
+
+/* sort_pairs_thread: sort and remove duplicates in the neighbor lists of
+ * words first ... last-1. The new size of each list is stored in count.
+ */
+void *sort_pairs_thread(void *arg)
+{
+	struct pairs_job *job = arg;
+	long w, i, n;
+	int *list;
+
+	for (w = job->first; w < job->last; ++w)
+	{
+		list = job->p->neighbors + job->p->offsets[w];
+		n    = job->p->offsets[w+1] - job->p->offsets[w];
+
+		qsort(list, n, sizeof *list, compare_ints);
+		for (i = 1, job->count[w] = (n > 0); i < n; ++i)
+			if (list[i] != list[job->count[w] - 1])
+				list[job->count[w]++] = list[i];
+	}
+
+	return NULL;
+}
+
+/* run_parallel: call fn(&jobs[i]) in one thread for each of the n jobs and
+ * wait for all of them.
+ */
+void run_parallel(int n, void *(*fn)(void *), struct pairs_job *jobs)
+{
+	pthread_t *threads;
+	int i;
+
+	if ((threads = calloc(n, sizeof *threads)) == NULL)
+	{
+		printf("Cannot allocate memory for threads\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+		pthread_create(&threads[i], NULL, fn, &jobs[i]);
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
+/* build_pair_sets: create the hash sets of words with more than PAIRS_HASHED
+ * neighbors. Sets are filled at most at 50%.
+ */
+void build_pair_sets(struct pairs *p)
+{
+	long w, i, n, size, total, h;
+	int *set;
+
+	p->set_offsets = calloc(vocab_size + 1, sizeof *p->set_offsets);
+	if (p->set_offsets == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+
+	for (w = 0, total = 0; w < vocab_size; ++w)
+	{
+		p->set_offsets[w] = total;
+		if ((n = p->offsets[w+1] - p->offsets[w]) <= PAIRS_HASHED)
+			continue;
+
+		for (size = 1; size < 2 * n; size *= 2)
+			continue;
+		total += size;
+	}
+	p->set_offsets[vocab_size] = total;
+
+	if ((p->sets = malloc((total + 1) * sizeof *p->sets)) == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+	memset(p->sets, -1, (total + 1) * sizeof *p->sets);
+
+	for (w = 0; w < vocab_size; ++w)
+	{
+		set  = p->sets + p->set_offsets[w];
+		size = p->set_offsets[w+1] - p->set_offsets[w];
+		for (i = p->offsets[w]; size > 0 && i < p->offsets[w+1]; ++i)
+		{
+			h = set_slot(p->neighbors[i], size);
+			while (set[h] != -1)
+				h = (h + 1) & (size - 1);
+			set[h] = p->neighbors[i];
+		}
+	}
+}
+
+/* read_pairs: read the file containing pairs of words and store them in p.
+ * For each pair, add it in the neighbor lists of both words involved. Return
+ * 1 if the file can not be read, 0 otherwise.
+ */
+int read_pairs(char *filename, struct pairs *p)
+{
+	struct pairs_job *jobs;
+	char *data;
+	long size, total, i, w, *count;
+	int n = args.num_threads;
+
+	if (n < 1)
+		n = 1;
+
+	/* words without any pair have an empty list */
+	p->offsets   = calloc(vocab_size + 1, sizeof *p->offsets);
+	p->neighbors = NULL;
+	count        = calloc(vocab_size + 1, sizeof *count);
+	jobs         = calloc(n, sizeof *jobs);
+	if (p->offsets == NULL || count == NULL || jobs == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+
+	if ((data = map_file(filename, &size)) == NULL)
+	{
+		free(count);
+		free(jobs);
+		build_pair_sets(p);
+		return 1;
+	}
+
+	/* first pass: parse lines, a line belongs to the part it starts in */
+	for (i = 0; i < n; ++i)
+	{
+		jobs[i].begin = data + size / n * i;
+		while (jobs[i].begin > data && jobs[i].begin < data + size &&
+		       jobs[i].begin[-1] != '\n')
+			++jobs[i].begin;
+		jobs[i].count = count;
+		jobs[i].p     = p;
+	}
+	for (i = 0; i < n; ++i)
+		jobs[i].end = (i == n - 1) ? data + size : jobs[i+1].begin;
+	run_parallel(n, parse_pairs_thread, jobs);
+	munmap(data, size);
+
+	/* offsets are the prefix sum of the number of neighbors */
+	for (w = 0, total = 0; w < vocab_size; ++w)
+	{
+		p->offsets[w] = total;
+		total += count[w];
+		count[w] = p->offsets[w];
+	}
+	p->offsets[vocab_size] = total;
+
+	if ((p->neighbors = malloc((total + 1) * sizeof *p->neighbors)) == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+
+	/* second pass: copy pairs into their lists */
+	run_parallel(n, fill_pairs_thread, jobs);
+
+	/* sort lists, each thread gets about the same number of neighbors */
+	for (i = 0, w = 0; i < n; ++i)
+	{
+		jobs[i].first = w;
+		while (w < vocab_size && p->offsets[w] < total / n * (i+1))
+			++w;
+		jobs[i].last = (i == n - 1) ? vocab_size : w;
+	}
+	run_parallel(n, sort_pairs_thread, jobs);
+
+	/* remove the space left by duplicates. New offsets are never greater
+	 * than old ones, so lists can be moved in place. */
+	for (w = 0, total = 0; w < vocab_size; ++w)
+	{
+		memmove(p->neighbors + total, p->neighbors + p->offsets[w],
+		        count[w] * sizeof *p->neighbors);
+		p->offsets[w] = total;
+		total += count[w];
+	}
+	p->offsets[vocab_size] = total;
+	p->neighbors = realloc(p->neighbors, (total + 1) * sizeof *p->neighbors);
+
+	free(count);
+	free(jobs);
+	build_pair_sets(p);
+	return 0;
+}
+
+/* index_paired_words: give a rank to each word with at least one strong or
+ * weak pair. Threads only keep pairs cursors for these words.
+ */
+void index_paired_words()
+{
+	long w;
+
+	if ((paired = malloc((vocab_size + 1) * sizeof *paired)) == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+
+	for (w = 0, n_paired = 0; w < vocab_size; ++w)
+	{
+		if (strong.offsets[w+1] > strong.offsets[w] ||
+		    weak.offsets[w+1] > weak.offsets[w])
+			paired[w] = n_paired++;
+		else
+			paired[w] = -1;
+	}
+}
+
+/* read_strong_pairs; read the file containing the strong pairs. For each pair,
+ * add it in the vocab for both words involved.
+ */
+int read_strong_pairs(char *filename)
+{
+	if (read_pairs(filename, &strong) != 0)
+	{
+		printf("WARNING: strong pairs data not found!\n"
+		       "Not taken into account during learning.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* read_weak_pairs: read the file containing the weak pairs. For each pair, add
+ * it in the vocab for both words involved.
+ */
+int read_weak_pairs(char *filename)
+{
+	if (read_pairs(filename, &weak) != 0)
+	{
+		printf("WARNING: weak pairs data not found!\n"
+		       "Not taken into account during learning.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* corpus_part: set [*begin, *end) to the i-th of n parts of the mapped input
+ * file. A word belongs to the part in which it starts.
+ */
+void corpus_part(int i, int n, char **begin, char **end)
+{
+	*begin = token_boundary(corpus.data + file_size / n * i);
+	*end   = (i == n - 1) ? corpus.end : corpus.data + file_size / n * (i+1);
+}
+
+/* A queue hands numbered buffers from producer threads to consumer threads.
+ * Free buffers are kept on a stack and filled ones in a FIFO. The time spent
+ * waiting for a free buffer (the queue is full, consumers are too slow) and
+ * for a filled one (the queue is empty, producers are too slow) is summed,
+ * to size the queue and the number of producers.
+ */
+struct queue
+{
+	int    *free, n_free;       /* stack of free buffers */
+	int    *full, head, n_full; /* FIFO of filled buffers */
+	int    n;                   /* number of buffers */
+	int    producers;           /* producers still running */
+	double full_wait;           /* seconds waited by producers */
+	double empty_wait;          /* seconds waited by consumers */
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;       /* a buffer was filled or given back */
+};
+
+/* init_queue: allocate a queue of n buffers */
+void init_queue(struct queue *q, int n)
+{
+	q->n    = n;
+	q->free = calloc(n, sizeof *q->free);
+	q->full = calloc(n, sizeof *q->full);
+	if (q->free == NULL || q->full == NULL)
+	{
+		printf("Cannot allocate memory for a queue\n");
+		exit(1);
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+/* reset_queue: make all buffers of q free, for a run of producers */
+void reset_queue(struct queue *q, int producers)
+{
+	int i;
+
+	for (i = 0; i < q->n; ++i)
+		q->free[i] = i;
+	q->n_free    = q->n;
+	q->head      = q->n_full = 0;
+	q->producers = producers;
+}
+
+/* destroy_queue: free the memory of q */
+void destroy_queue(struct queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->free);
+	free(q->full);
+}
+
+/* queue_get_free: return a free buffer of q, waiting for one if needed */
+int queue_get_free(struct queue *q)
+{
+	double t;
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->n_free == 0)
+	{
+		t = wall_time();
+		while (q->n_free == 0)
+			pthread_cond_wait(&q->cond, &q->lock);
+		q->full_wait += wall_time() - t;
+	}
+	i = q->free[--q->n_free];
+	pthread_mutex_unlock(&q->lock);
+	return i;
+}
+
+/* queue_push: add the filled buffer i to q */
+void queue_push(struct queue *q, int i)
+{
+	pthread_mutex_lock(&q->lock);
+	q->full[(q->head + q->n_full++) % q->n] = i;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* queue_give_back: make buffer i of q free again */
+void queue_give_back(struct queue *q, int i)
+{
+	pthread_mutex_lock(&q->lock);
+	q->free[q->n_free++] = i;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* queue_done: a producer of q has pushed all its buffers */
+void queue_done(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	--q->producers;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* queue_pop: give back the buffer *slot (if not -1) and set *slot to the
+ * next filled buffer of q, waiting for one if needed. Return 0 when all
+ * producers are done and q is empty. */
+int queue_pop(struct queue *q, int *slot)
+{
+	double t;
+
+	pthread_mutex_lock(&q->lock);
+	if (*slot != -1)
+	{
+		q->free[q->n_free++] = *slot;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	if (q->n_full == 0 && q->producers > 0)
+	{
+		t = wall_time();
+		while (q->n_full == 0 && q->producers > 0)
+			pthread_cond_wait(&q->cond, &q->lock);
+		q->empty_wait += wall_time() - t;
+	}
+	if (q->n_full == 0)
+	{
+		*slot = -1;
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+
+	*slot = q->full[q->head];
+	q->head = (q->head + 1) % q->n;
+	--q->n_full;
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+/* With -input - (standard input), a named pipe as -input, or -input-cmd
+ * <command> (run by the shell), the input is streamed instead of mapped, so
+ * it does not need to be written to disk first. A reader thread reads it in
+ * blocks of about STREAM_BLOCK bytes ending on a word boundary and hands them
+ * to the threads through a queue of STREAM_QUEUE blocks per thread; a thread
+ * gives its block back when it claims the next one. Each pass over the input
+ * (the count of the vocabulary, unless -read-vocab is given, then each epoch)
+ * runs the command again. A pipe can only be read once: reopened, it could be
+ * written by the next producer before the end of the last pass is seen.
+ */
+#define STREAM_BLOCK (1024 * 1024)
+#define STREAM_QUEUE 2
+
+struct stream
+{
+	int   on;                 /* the input is streamed */
+	int   passes;             /* passes started over the input */
+	FILE  *fi;                /* input of the current pass */
+	char  **blocks;           /* buffers of STREAM_BLOCK + MAXLEN bytes */
+	long  *lens;              /* bytes of words in each buffer */
+	struct queue q;
+	pthread_t reader;
+} stream;
+
+/* is_stream: return 1 if the input must be streamed */
+int is_stream()
+{
+	struct stat st;
+
+	if (args.input_cmd[0] != '\0' || strcmp(args.input, "-") == 0)
+		return 1;
+	return stat(args.input, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* init_stream: allocate the buffers of the queue. Reader threads of -readers
+ * claim blocks too. */
+void init_stream()
+{
+	int i, n = STREAM_QUEUE * (args.num_threads + args.readers) + 1;
+
+	init_queue(&stream.q, n);
+	stream.blocks = calloc(n, sizeof *stream.blocks);
+	stream.lens   = calloc(n, sizeof *stream.lens);
+	if (stream.blocks == NULL || stream.lens == NULL)
+	{
+		printf("Cannot allocate memory to stream the input\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+		if ((stream.blocks[i] = malloc(STREAM_BLOCK + MAXLEN)) == NULL)
+		{
+			printf("Cannot allocate memory to stream the input\n");
+			exit(1);
+		}
+}
+
+/* destroy_stream: free the buffers of the queue */
+void destroy_stream()
+{
+	int i;
+
+	for (i = 0; i < stream.q.n; ++i)
+		free(stream.blocks[i]);
+	free(stream.blocks);
+	free(stream.lens);
+	destroy_queue(&stream.q);
+}
+
+/* read_block: read the next block of fi in buf after the *n_carry bytes of
+ * carry, which are the start of a word cut by the previous block. Set carry
+ * to the end of this block after its last separator, and return the number of
+ * bytes of buf before it (0 at the end of the input). Like token_boundary(),
+ * a word longer than MAXLEN-1 is cut at a multiple of MAXLEN-1 characters from
+ * its start, so next_token() splits it as in a mapped file. Every block thus
+ * begins at the start of a word or of one of its chunks.
+ */
+long read_block(FILE *fi, char *buf, char *carry, long *n_carry)
+{
+	long len, cut, start, read;
+
+	memcpy(buf, carry, *n_carry);
+	read = fread(buf + *n_carry, 1, STREAM_BLOCK, fi);
+	len  = *n_carry + read;
+	*n_carry = 0;
+	if (read < STREAM_BLOCK)
+		return len;
+
+	for (start = len; start > 0 && !is_space(buf[start-1]); --start)
+		continue;
+	cut = start + (len - start) / (MAXLEN - 1) * (MAXLEN - 1);
+	*n_carry = len - cut;
+	memcpy(carry, buf + cut, *n_carry);
+	return cut;
+}
+
+/* reader_thread: read a whole pass over the input into the queue */
+void *reader_thread(void *arg)
+{
+	char carry[MAXLEN];
+	long n_carry = 0, len;
+	int i;
+
+	(void) arg;
+	for (;;)
+	{
+		i   = queue_get_free(&stream.q);
+		len = read_block(stream.fi, stream.blocks[i], carry, &n_carry);
+		if (len == 0)
+		{
+			queue_give_back(&stream.q, i);
+			queue_done(&stream.q);
+			return NULL;
+		}
+
+		stream.lens[i] = len;
+		queue_push(&stream.q, i);
+	}
+}
+
+/* start_stream: start a pass over the input, read by the reader thread */
+void start_stream()
+{
+	if (args.input_cmd[0] != '\0')
+		stream.fi = popen(args.input_cmd, "r");
+	else if (stream.passes > 0)
+		stream.fi = NULL;
+	else if (strcmp(args.input, "-") == 0)
+		stream.fi = stdin;
+	else
+		stream.fi = fopen(args.input, "r");
+	if (stream.fi == NULL)
+	{
+		printf("ERROR: cannot read the input for pass %d\n",
+		       stream.passes + 1);
+		exit(1);
+	}
+	++stream.passes;
+
+	reset_queue(&stream.q, 1);
+	pthread_create(&stream.reader, NULL, reader_thread, NULL);
+}
+
+/* stop_stream: wait for the end of the pass over the input */
+void stop_stream()
+{
+	pthread_join(stream.reader, NULL);
+	if (args.input_cmd[0] != '\0')
+	{
+		if (pclose(stream.fi) != 0)
+		{
+			printf("\nERROR: -input-cmd failed during pass %d\n",
+			       stream.passes);
+			exit(1);
+		}
+	}
+	else if (stream.fi != stdin)
+		fclose(stream.fi);
+}
+
+/* claim_block: give back the block *slot (if not -1) and claim the next one
+ * of the stream in [*cur, *end). Return 0 at the end of the pass. */
+int claim_block(int *slot, char **cur, char **end)
+{
+	if (!queue_pop(&stream.q, slot))
+		return 0;
+
+	*cur = stream.blocks[*slot];
+	*end = *cur + stream.lens[*slot];
+	return 1;
+}
+
+/* Each thread counts the words of its part of the input file into its own
+ * hash table, without any lock. Words are not copied: cells point directly
+ * inside the mapped file. Tables are merged into the vocabulary at the end.
+ * A streamed input is counted by all threads from the blocks they claim,
+ * and words are copied since blocks are reused.
+ */
+struct word_count
+{
+	char *word;
+	int  len;
+	unsigned int hashval;
+	long count;
+};
+
+/* count_slot: first cell to look at for hash value hv in a table of size
+ * cells, a power of 2. hv holds the low 32 bits of hash_string(), which are
+ * already mixed, so the cell is only the low bits of hv. */
+static inline long count_slot(unsigned int hv, long size)
+{
+	return hv & (size - 1);
+}
+
+struct count_job
+{
+	char *begin, *end;         /* part of the input file to read */
+	struct word_count *cells;  /* hash table of words */
+	long size;                 /* number of cells, power of 2 */
+	long used;                 /* number of non-empty cells */
+	long words;                /* number of words read */
+};
+
+/* count_table_grow: double the number of cells of the table of job */
+void count_table_grow(struct count_job *job)
+{
+	struct word_count *old = job->cells;
+	long i, h, old_size = job->size;
+
+	job->size *= 2;
+	if ((job->cells = calloc(job->size, sizeof *job->cells)) == NULL)
+	{
+		printf("Cannot allocate memory to count words\n");
+		exit(1);
+	}
+
+	for (i = 0; i < old_size; ++i)
+	{
+		if (old[i].word == NULL)
+			continue;
+
+		h = count_slot(old[i].hashval, job->size);
+		while (job->cells[h].word != NULL)
+			h = (h + 1) & (job->size - 1);
+		job->cells[h] = old[i];
+	}
+
+	free(old);
+}
+
+/* count_range: count the occurrences of each word starting in [begin, end),
+ * words ending before limit */
+void count_range(struct count_job *job, char *begin, char *end, char *limit)
+{
+	struct word_count *cell;
+	char *cur, *word;
+	unsigned int hv;
+	long h;
+	int len;
+
+	cur = begin;
+	while (cur < end)
+	{
+		if ((len = next_token(&cur, limit, &word)) == 0 || word >= end)
+			break;
+
+		/* print progress of the whole vocabulary pass */
+		if (++job->words % 500000 == 0)
+		{
+			printf("%ldK%c", __atomic_add_fetch(&train_words, 500000,
+			       __ATOMIC_RELAXED) / 1000, 13);
+			fflush(stdout);
+		}
+
+		hv = hash_string(word, len);
+		h  = count_slot(hv, job->size);
+		for (cell = &job->cells[h]; cell->word != NULL;
+		     cell = &job->cells[h])
+		{
+			if (cell->hashval == hv && cell->len == len &&
+			    memcmp(cell->word, word, len) == 0)
+				break;
+			h = (h + 1) & (job->size - 1);
+		}
+
+		if (cell->word != NULL)
+		{
+			cell->count++;
+			continue;
+		}
+
+		if (stream.on && (word = strndup(word, len)) == NULL)
+		{
+			printf("Cannot allocate memory to count words\n");
+			exit(1);
+		}
+		cell->word    = word;
+		cell->len     = len;
+		cell->hashval = hv;
+		cell->count   = 1;
+
+		/* keep the load factor under 1/2 */
+		if (++job->used * 2 > job->size)
+			count_table_grow(job);
+	}
+}
+
+/* count_thread: count the occurrences of each word starting in the part
+ * [begin, end) of the mapped input file, or in the blocks of the stream.
+ */
+void *count_thread(void *arg)
+{
+	struct count_job *job = arg;
+	char *begin, *end;
+	int slot = -1;
+
+	job->size = 1 << 16;
+	job->used = job->words = 0;
+	if ((job->cells = calloc(job->size, sizeof *job->cells)) == NULL)
+	{
+		printf("Cannot allocate memory to count words\n");
+		exit(1);
+	}
+
+	if (!stream.on)
+		count_range(job, job->begin, job->end, corpus.end);
+	else
+		while (claim_block(&slot, &begin, &end))
+			count_range(job, begin, end, end);
+
+	return NULL;
+}
+
+/* count_words: split the input file into one part per thread, count the words
+ * of each part in parallel and merge the counts into the vocabulary.
+ */
+void count_words(int num_threads)
+{
+	struct count_job *jobs;
+	pthread_t *threads;
+	long i, j;
+
+	if (num_threads < 1)
+		num_threads = 1;
+
+	jobs    = calloc(num_threads, sizeof *jobs);
+	threads = calloc(num_threads, sizeof *threads);
+	if (jobs == NULL || threads == NULL)
+	{
+		printf("Cannot allocate memory to count words\n");
+		exit(1);
+	}
+
+	if (stream.on)
+		start_stream();
+	for (i = 0; i < num_threads; ++i)
+	{
+		if (!stream.on)
+			corpus_part(i, num_threads, &jobs[i].begin,
+			            &jobs[i].end);
+		pthread_create(&threads[i], NULL, count_thread, &jobs[i]);
+	}
+	for (i = 0; i < num_threads; ++i)
+		pthread_join(threads[i], NULL);
+	if (stream.on)
+		stop_stream();
+
+	/* merge counts of each thread in the vocabulary */
+	train_words = 0;
+	for (i = 0; i < num_threads; ++i)
+	{
+		train_words += jobs[i].words;
+		for (j = 0; j < jobs[i].size; ++j)
+			if (jobs[i].cells[j].word != NULL)
+			{
+				add_word(jobs[i].cells[j].word,
+				         jobs[i].cells[j].len,
+				         jobs[i].cells[j].count);
+				if (stream.on)
+					free(jobs[i].cells[j].word);
+			}
+		free(jobs[i].cells);
+	}
+
+	free(threads);
+	free(jobs);
+}
+
+/* A vocabulary saved with -save-vocab holds the counts of all words of the
+ * input, before -min-count is applied, one "word count" line per word, so
+ * runs with other parameters can read it with -read-vocab instead of counting
+ * the input again. Its first line identifies the input it was counted on:
+ * "#dict2vec-vocab <size> <mtime> <hash>", where hash covers VOCAB_SAMPLES
+ * blocks of VOCAB_BLOCK bytes spread over the whole input. Files without this
+ * line (written by hand or by word2vec) are read without any check, as are
+ * streamed inputs, which can not be identified.
+ */
+#define VOCAB_HEADER  "#dict2vec-vocab"
+#define VOCAB_SAMPLES 64
+#define VOCAB_BLOCK   4096
+
+/* vocab_header: write in line the first line of a vocabulary counted on the
+ * mapped input. Return 0 if the input is streamed. */
+int vocab_header(char *line)
+{
+	struct stat st;
+	uint64_t h = 14695981039346656037ULL;
+	long i, pos, len;
+
+	if (stream.on || stat(args.input, &st) != 0)
+		return 0;
+
+	len = (file_size < VOCAB_BLOCK) ? file_size : VOCAB_BLOCK;
+	for (i = 0; i < VOCAB_SAMPLES; ++i)
+	{
+		pos = (file_size - len) / (VOCAB_SAMPLES - 1) * i;
+		if (i == VOCAB_SAMPLES - 1)
+			pos = file_size - len;
+		h = (h ^ hash_string(corpus.data + pos, len)) *
+		    1099511628211ULL;
+	}
+
+	sprintf(line, "%s %ld %ld %016llx\n", VOCAB_HEADER, file_size,
+	        (long) st.st_mtime, (unsigned long long) h);
+	return 1;
+}
+
+/* save_vocab_file: write the words of the vocabulary and their counts in
+ * filename */
+void save_vocab_file(char *filename)
+{
+	char header[MAXLINE];
+	long i;
+	FILE *fo;
+
+	if ((fo = fopen(filename, "w")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+
+	if (vocab_header(header))
+		fputs(header, fo);
+	for (i = 0; i < vocab_size; ++i)
+		fprintf(fo, "%s %ld\n", vocab_word(i), vocab[i].count);
+
+	if (fclose(fo) != 0)
+	{
+		printf("ERROR: cannot write vocabulary file %s\n", filename);
+		exit(1);
+	}
+}
+
+/* read_vocab_file: add the words of the -read-vocab file to the vocabulary.
+ * Each line holds a word and its number of occurrences in the input.
+ */
+void read_vocab_file(char *filename)
+{
+	char word[MAXLEN], line[MAXLINE], expected[MAXLINE];
+	long count;
+	FILE *fi;
+
+	if ((fi = fopen(filename, "r")) == NULL)
+	{
+		printf("ERROR: vocabulary file %s not found!\n", filename);
+		exit(1);
+	}
+
+	/* check that the input has not changed since it was counted */
+	if (fgets(line, MAXLINE, fi) != NULL &&
+	    strncmp(line, VOCAB_HEADER " ", strlen(VOCAB_HEADER) + 1) == 0)
+	{
+		if (vocab_header(expected) && strcmp(line, expected) != 0)
+		{
+			printf("ERROR: vocabulary file %s was counted on another "
+			       "input, or -input has changed since\n", filename);
+			exit(1);
+		}
+	}
+	else
+		rewind(fi);
+
+	train_words = 0;
+	while (fscanf(fi, "%99s %ld", word, &count) == 2)
+	{
+		add_word(word, strlen(word), count);
+		train_words += count;
+	}
+	fclose(fi);
+}
+
+/* read_vocab: read the file given as -input. For each word, either add it in
+ * the vocab or increment its occurrence. Also read the strong and weak pairs
  * files if provided. Sort the vocabulary by occurrences and display some infos.
  */
-void read_vocab(char *input_fn, char *strong_fn, char *weak_fn)
+void read_vocab(char *input_fn, char *strong_fn, char *weak_fn)
+{
+	int failure_strong, failure_weak;
+	double t = wall_time();
+
+	if (!stream.on)
+		open_corpus(input_fn);
+
+	/* start with an empty hash table, grown as words are added */
+	resize_vocab_hash(0);
+
+	/* each thread counts words of one part of the mapped file (or of the
+	 * stream), unless the counts are given */
+	if (args.read_vocab[0] != '\0')
+		read_vocab_file(args.read_vocab);
+	else
+		count_words(args.num_threads);
+	if (args.save_vocab[0] != '\0')
+		save_vocab_file(args.save_vocab);
+
+	sort_and_reduce_vocab();
+
+	printf("Vocab size: %ld\n", vocab_size);
+	printf("Words in train file: %ld\n", train_words);
+	end_phase(PHASE_VOCAB, t);
+
+	t = wall_time();
+	printf("Adding strong pairs...");
+	failure_strong = read_strong_pairs(strong_fn);
+	printf("\nAdding weak pairs...");
+	failure_weak = read_weak_pairs(weak_fn);
+	if (!failure_strong || !failure_weak)
+		printf("\nAdding pairs done.\n");
+	index_paired_words();
+	end_phase(PHASE_PAIRS, t);
+
+	/* compute the discard probability for each word (1 if we do not
+	 * subsample) */
+	compute_discard_prob();
+
+	/* threads jump to random places of the mapped file during training */
+	if (!stream.on)
+		madvise(corpus.data, file_size, MADV_RANDOM);
+}
+
+/* vocab_fingerprint: 64 bits FNV-1a hash of all words of the vocabulary and
+ * their number of occurrences, in the order of the vocabulary. Two id caches
+ * built with the same fingerprint contain the same indexes.
+ */
+uint64_t vocab_fingerprint()
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned char *p;
+	long i, j;
+
+	for (i = 0; i < vocab_size; ++i)
+	{
+		for (p = (unsigned char *) vocab_word(i); ; ++p)
+		{
+			h = (h ^ *p) * 1099511628211ULL;
+			if (*p == '\0')
+				break;
+		}
+
+		p = (unsigned char *) &vocab[i].count;
+		for (j = 0; j < (long) sizeof vocab[i].count; ++j)
+			h = (h ^ p[j]) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/* next_id: decode the index of word at *cur in the id cache and move *cur to
+ * the next one. Return -2 at the end of the cache.
+ */
+static inline int next_id(char **cur, char *end)
+{
+	unsigned char *p = (unsigned char *) *cur;
+	unsigned int id, shift;
+
+	if (*cur >= end)
+		return -2;
+
+	if (!ids.varint)
+	{
+		*cur += sizeof(uint32_t);
+		return *(uint32_t *) p;
+	}
+
+	for (id = 0, shift = 0; *p & 0x80; ++p, shift += 7)
+		id |= (*p & 0x7F) << shift;
+	id |= *p++ << shift;
+
+	*cur = (char *) p;
+	return id;
+}
+
+/* id_boundary: return the first index of the id cache starting at or after
+ * the i-th of n parts of the cache.
+ */
+char *id_boundary(int i, int n)
+{
+	long n_ids;
+	char *p;
+
+	if (!ids.varint)
+	{
+		n_ids = (ids.end - ids.data) / sizeof(uint32_t);
+		return ids.data + n_ids / n * i * sizeof(uint32_t);
+	}
+
+	/* the last byte of each varint has its high bit cleared */
+	p = ids.data + (ids.end - ids.data) / n * i;
+	if (p > ids.data)
+		while (p < ids.end && (p[-1] & 0x80))
+			++p;
+	return p;
+}
+
+/* Each thread encodes the words of its part of the input file into its own
+ * buffer. Buffers are then written in order into the id cache file.
+ */
+struct encode_job
+{
+	char *begin, *end;  /* part of the input file to encode */
+	unsigned char *buf;
+	long size;          /* number of bytes used in buf */
+	long capacity;
+	long n_ids;
+};
+
+/* encode_thread: write the index of each word in vocab starting in the part
+ * [begin, end) of the mapped input file.
+ */
+void *encode_thread(void *arg)
+{
+	struct encode_job *job = arg;
+	char *cur, *word;
+	unsigned int id;
+	int len, w;
+
+	job->capacity = 1 << 20;
+	job->size = job->n_ids = 0;
+	job->buf = malloc(job->capacity);
+
+	cur = job->begin;
+	while (job->buf != NULL && cur < job->end)
+	{
+		if ((len = next_token(&cur, corpus.end, &word)) == 0 ||
+		    word >= job->end)
+			break;
+
+		if ((w = search_vocab(word, len)) == -1)
+			continue;
+
+		/* a varint of a 32 bits integer uses at most 5 bytes */
+		if (job->size + 5 > job->capacity)
+		{
+			job->capacity *= 2;
+			job->buf = realloc(job->buf, job->capacity);
+			if (job->buf == NULL)
+				break;
+		}
+
+		++job->n_ids;
+		if (!args.cache_varint)
+		{
+			memcpy(job->buf + job->size, &w, sizeof(uint32_t));
+			job->size += sizeof(uint32_t);
+			continue;
+		}
+
+		for (id = w; id >= 0x80; id >>= 7)
+			job->buf[job->size++] = (id & 0x7F) | 0x80;
+		job->buf[job->size++] = id;
+	}
+
+	if (job->buf == NULL)
+	{
+		printf("Cannot allocate memory to encode the input file\n");
+		exit(1);
+	}
+
+	return NULL;
+}
+
+/* write_id_cache: encode the input file in parallel and write the indexes of
+ * its words in filename.
+ */
+void write_id_cache(char *filename, uint64_t fingerprint)
+{
+	struct id_cache_header header;
+	struct encode_job *jobs;
+	pthread_t *threads;
+	FILE *fo;
+	int i, n = args.num_threads;
+
+	jobs    = calloc(n, sizeof *jobs);
+	threads = calloc(n, sizeof *threads);
+	if (jobs == NULL || threads == NULL)
+	{
+		printf("Cannot allocate memory to encode the input file\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		corpus_part(i, n, &jobs[i].begin, &jobs[i].end);
+		pthread_create(&threads[i], NULL, encode_thread, &jobs[i]);
+	}
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, "D2VI", 4);
+	header.varint      = args.cache_varint != 0;
+	header.fingerprint = fingerprint;
+	header.vocab_size  = vocab_size;
+	for (i = 0; i < n; ++i)
+	{
+		header.n_ids     += jobs[i].n_ids;
+		header.data_size += jobs[i].size;
+	}
+
+	if ((fo = fopen(filename, "wb")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+
+	fwrite(&header, sizeof header, 1, fo);
+	for (i = 0; i < n; ++i)
+	{
+		fwrite(jobs[i].buf, 1, jobs[i].size, fo);
+		free(jobs[i].buf);
+	}
+
+	if (fclose(fo) != 0)
+	{
+		printf("ERROR: cannot write id cache %s\n", filename);
+		exit(1);
+	}
+
+	free(threads);
+	free(jobs);
+}
+
+/* map_id_cache: map filename in memory if it is a valid id cache for the
+ * current vocabulary. Return 0 on success, 1 otherwise.
+ */
+int map_id_cache(char *filename, uint64_t fingerprint)
+{
+	struct id_cache_header *header;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return 1;
+
+	if (fstat(fd, &st) == -1 || st.st_size < (long) sizeof *header ||
+	    (ids.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED)
+	{
+		close(fd);
+		ids.map = NULL;
+		return 1;
+	}
+
+	close(fd);
+	ids.map_size = st.st_size;
+	header = (struct id_cache_header *) ids.map;
+
+	if (memcmp(header->magic, "D2VI", 4) ||
+	    header->fingerprint != fingerprint ||
+	    header->vocab_size != (uint64_t) vocab_size ||
+	    header->n_ids != (uint64_t) train_words ||
+	    header->data_size != st.st_size - sizeof *header)
+	{
+		munmap(ids.map, ids.map_size);
+		ids.map = NULL;
+		return 1;
+	}
+
+	ids.varint = header->varint;
+	ids.data   = ids.map + sizeof *header;
+	ids.end    = ids.data + header->data_size;
+	madvise(ids.map, ids.map_size, MADV_RANDOM);
+	return 0;
+}
+
+/* load_id_cache: use the id cache in filename for training. The cache is
+ * (re)built from the input file if it does not exist or if it was built with
+ * another vocabulary.
+ */
+void load_id_cache(char *filename)
+{
+	uint64_t fingerprint = vocab_fingerprint();
+
+	if (map_id_cache(filename, fingerprint) == 0)
+	{
+		printf("Using id cache %s\n", filename);
+		return;
+	}
+
+	printf("Writing id cache %s\n", filename);
+	write_id_cache(filename, fingerprint);
+
+	if (map_id_cache(filename, fingerprint) != 0)
+	{
+		printf("ERROR: cannot read id cache %s\n", filename);
+		exit(1);
+	}
+}
+
+/* close_id_cache: unmap the id cache */
+void close_id_cache()
+{
+	if (ids.map != NULL)
+		munmap(ids.map, ids.map_size);
+	ids.map = ids.data = ids.end = NULL;
+}
+
+/* input_part: return the position of the first word of the i-th of n parts of
+ * the training data (id cache if there is one, input file otherwise).
+ */
+char *input_part(int i, int n)
+{
+	return (ids.data != NULL) ? id_boundary(i, n) :
+	       token_boundary(corpus.data + file_size / n * i);
+}
+
+/* next_word: return the index in vocab of the word at *cur and move *cur to
+ * the next word. Return -1 if the word is not in vocab and -2 if there are no
+ * more words before end.
+ */
+static inline int next_word(char **cur, char *end)
+{
+	char *word;
+	int len;
+
+	if (ids.data != NULL)
+		return next_id(cur, end);
+
+	if ((len = next_token(cur, end, &word)) == 0)
+		return -2;
+	return search_vocab(word, len);
+}
+
+/* Rows of WI and WO are padded to a multiple of ROW_ALIGN floats (a cache
+ * line), so a row never straddles more cache lines than needed and starts on
+ * an aligned address. The padding is never written in any output. With
+ * -huge-pages, the matrices are also backed by 2 MB pages so random rows of a
+ * large matrix do not miss the TLB at each access.
+ */
+#define ROW_ALIGN 16
+#define HUGE_PAGE (2L * 1024 * 1024)
+
+/* alloc_matrix: map matrix_bytes of zeroed memory for the matrix name,
+ * aligned on a page (on a huge page with -huge-pages) */
+float *alloc_matrix(const char *name)
+{
+	char *p = MAP_FAILED;
+	long head;
+
+	if (args.huge_pages == 2)
+	{
+		p = mmap(NULL, matrix_bytes, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return (float *) p;
+		printf("WARNING: no huge pages reserved for %s, using "
+		       "transparent huge pages\n", name);
+	}
+
+	if (!args.huge_pages)
+		p = mmap(NULL, matrix_bytes, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+	{
+		/* map one more huge page and unmap what is around the first
+		 * aligned one, so the kernel can use huge pages for all of it */
+		p = mmap(NULL, matrix_bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			head = (HUGE_PAGE - (uintptr_t) p % HUGE_PAGE) % HUGE_PAGE;
+			if (head > 0)
+				munmap(p, head);
+			if (HUGE_PAGE - head > 0)
+				munmap(p + head + matrix_bytes, HUGE_PAGE - head);
+			p += head;
+			if (madvise(p, matrix_bytes, MADV_HUGEPAGE) != 0)
+				printf("WARNING: no transparent huge pages for "
+				       "%s\n", name);
+		}
+	}
+
+	if (p == MAP_FAILED)
+	{
+		printf("Memory allocation failed for %s\n", name);
+		exit(1);
+	}
+	return (float *) p;
+}
+
+/* init_network: initialize matrix WI (random values) and WO (zero values) */
+void init_network()
+{
+	float r, l;
+	long i, j;
+
+	row_size     = (args.dim + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+	matrix_bytes = vocab_size * row_size * sizeof *WI;
+	if (args.huge_pages)
+		matrix_bytes = (matrix_bytes + HUGE_PAGE - 1) / HUGE_PAGE *
+		               HUGE_PAGE;
+
+	/* pages are not touched yet, so they can still be placed */
+	WI = alloc_matrix("WI");
+	WO = alloc_matrix("WO");
+	numa_interleave(WI, matrix_bytes);
+	numa_interleave(WO, matrix_bytes);
+
+	/* WI is initialized with random values from (-0.5 / vec_dimension)
+	 * and (0.5 / vec_dimension). Multiply is faster than divide so
+	 * precompute 1 / RAND_MAX and 1 / dim. */
+	r = 1.0 / RAND_MAX;
+	l = 1.0 / args.dim;
+	for (i = 0; i < vocab_size; ++i)
+		for (j = 0; j < args.dim; ++j)
+			WI[i * row_size + j] = ( (rand() * r) - 0.5 ) * l;
+}
+
+/* destroy_network: free the memory allocated for matrices WI and WO */
+void destroy_network()
+{
+	if (WI != NULL)
+		munmap(WI, matrix_bytes);
+
+	if (WO != NULL)
+		munmap(WO, matrix_bytes);
+}
+
+/* next_random: return the next value of the xorshift64* generator of s */
+static inline uint64_t next_random(struct sampler *s)
+{
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* init_sampler: allocate the pairs cursors of s */
+void init_sampler(struct sampler *s)
+{
+	s->pos_sp  = calloc(n_paired + 1, sizeof *s->pos_sp);
+	s->pos_wp  = calloc(n_paired + 1, sizeof *s->pos_wp);
+	if (s->pos_sp == NULL || s->pos_wp == NULL)
+	{
+		printf("Cannot allocate memory for pairs cursors\n");
+		exit(1);
+	}
+}
+
+/* seed_sampler: seed the generator of s from the thread id and start its
+ * pairs cursors at random positions, so threads do not draw the same samples.
+ * Done once per thread, before its first epoch. The seed also depends on that
+ * epoch, so a run resumed after an epoch does not draw the samples of the
+ * first one again (checkpoints saved during an epoch restore the state).
+ */
+void seed_sampler(struct sampler *s, int id)
+{
+	long i, w;
+
+	s->rng = 0x9E3779B97F4A7C15ULL *
+	         (id + 1 + (uint64_t) current_epoch * args.num_threads);
+	for (w = 0; w < vocab_size; ++w)
+	{
+		if ((i = paired[w]) == -1)
+			continue;
+		if (strong.offsets[w+1] > strong.offsets[w])
+			s->pos_sp[i] = next_random(s) %
+			               (strong.offsets[w+1] - strong.offsets[w]);
+		if (weak.offsets[w+1] > weak.offsets[w])
+			s->pos_wp[i] = next_random(s) %
+			               (weak.offsets[w+1] - weak.offsets[w]);
+	}
+}
+
+/* destroy_sampler: free the cursors of s */
+void destroy_sampler(struct sampler *s)
+{
+	free(s->pos_sp);
+	free(s->pos_wp);
+}
+
+/* draw_negative: draw a word from the alias table with the generator of s.
+ * The high 32 bits of a random number choose the cell, the low 32 bits
+ * choose between the cell and its alias.
+ */
+static inline int draw_negative(struct sampler *s)
+{
+	uint64_t r = next_random(s);
+	long i = ((r >> 32) * vocab_size) >> 32;
+
+	if ((r & 0xFFFFFFFF) * (1.0 / 4294967296.0) < table[i].prob)
+		return i;
+	return table[i].alias;
+}
+
+/* draw_pair: return the next word of the n words of list, *cursor being the
+ * position of this word */
+static inline int draw_pair(int *cursor, const int *list, int n)
+{
+	if (*cursor > n - 1)
+		*cursor = 0;
+	return list[(*cursor)++];
+}
+
+/* Words are sorted by decreasing count, so the first rows of WO are the
+ * targets of most negative samples. With -hot-rows K, each thread updates its
+ * own copy of these K rows instead of WO, so threads do not invalidate each
+ * other's cache lines at each update. Every -hot-sync words trained, a thread
+ * adds to WO what its copy moved since the last merge (its delta) and
+ * restarts from the merged rows. The deltas of all threads are summed, as
+ * hogwild would have applied them; a merge racing with another one can lose
+ * a little of a delta, like any hogwild update.
+ */
+struct replica
+{
+	float *rows;   /* K rows updated by the thread */
+	float *base;   /* the same rows at the last merge */
+	long  words;   /* words trained since the last merge */
+};
+
+/* init_replica: allocate the rows of h */
+void init_replica(struct replica *h)
+{
+	if (args.hot_rows == 0)
+		return;
+
+	h->rows = aligned_alloc(64, args.hot_rows * row_size * sizeof *h->rows);
+	h->base = aligned_alloc(64, args.hot_rows * row_size * sizeof *h->base);
+	if (h->rows == NULL || h->base == NULL)
+	{
+		printf("Cannot allocate memory for the hot rows\n");
+		exit(1);
+	}
+}
+
+/* load_replica: copy the hot rows of WO in h */
+void load_replica(struct replica *h)
+{
+	long n = args.hot_rows * row_size;
+
+	memcpy(h->rows, WO, n * sizeof *WO);
+	memcpy(h->base, WO, n * sizeof *WO);
+	h->words = 0;
+}
+
+/* merge_replica: add the delta of h to WO, then restart h from WO */
+void merge_replica(struct replica *h)
+{
+	long i, n = args.hot_rows * row_size;
+
+	for (i = 0; i < n; ++i)
+		WO[i] += h->rows[i] - h->base[i];
+	load_replica(h);
+}
+
+/* destroy_replica: free the rows of h */
+void destroy_replica(struct replica *h)
+{
+	free(h->rows);
+	free(h->base);
+}
+
+/* out_row: row of WO of word w, the copy of h for the hot rows */
+static inline float *out_row(const struct replica *h, long w)
+{
+	return (w < args.hot_rows ? h->rows : WO) + w * row_size;
+}
+
+/* With -shared-negatives, all context words of a window are trained at once
+ * against the same targets: the central word, one set of negative samples
+ * drawn for the whole window, and the strong/weak pairs drawn for each
+ * context word. Dot products and updates become small dense matrix products
+ * (contexts x targets), so each row of WO is loaded once per window instead
+ * of once per context word.
+ *
+ * For the context word r and the target t, pos[r][t] is the sum of the
+ * coefficients of positive samples (1 for the central word, beta for pairs)
+ * and neg[r][t] the number of times t was drawn as a negative sample. The
+ * gradient is alpha * (pos * (1 - sigmoid(x)) - neg * sigmoid(x)).
+ */
+struct batch
+{
+	int   *contexts;      /* index of each context word */
+	int   *targets;       /* index of each target word, no duplicates */
+	float *pos, *neg;     /* coefficients, max_targets per context */
+	float *dx;            /* updates of WI rows */
+	float *x;             /* dot products of a context with the targets */
+	int   n_contexts, n_targets, max_targets;
+	long  updates;        /* number of dot products computed */
+	long  pair_draws;     /* number of strong and weak pairs drawn */
+};
+
+/* init_batch: allocate the buffers used to train a window */
+void init_batch(struct batch *b)
+{
+	int max_contexts = 2 * (args.window / 2);
+
+	b->max_targets = 1 + args.negative +
+	                 max_contexts * (args.strong_draws + args.weak_draws);
+	b->contexts = calloc(max_contexts, sizeof *b->contexts);
+	b->targets  = calloc(b->max_targets, sizeof *b->targets);
+	b->pos      = calloc(max_contexts * b->max_targets, sizeof *b->pos);
+	b->neg      = calloc(max_contexts * b->max_targets, sizeof *b->neg);
+	b->dx       = calloc(max_contexts * args.dim, sizeof *b->dx);
+	b->x        = calloc(b->max_targets, sizeof *b->x);
+
+	if (!b->contexts || !b->targets || !b->pos || !b->neg || !b->dx ||
+	    !b->x)
+	{
+		printf("Cannot allocate memory for batch training\n");
+		exit(1);
+	}
+}
+
+/* destroy_batch: free the buffers of b */
+void destroy_batch(struct batch *b)
+{
+	free(b->contexts);
+	free(b->targets);
+	free(b->pos);
+	free(b->neg);
+	free(b->dx);
+	free(b->x);
+}
+
+/* batch_target: return the column of target t in b, add it if needed */
+static inline int batch_target(struct batch *b, int t)
+{
+	int i, r;
+
+	for (i = 0; i < b->n_targets; ++i)
+		if (b->targets[i] == t)
+			return i;
+
+	b->targets[i] = t;
+	for (r = 0; r < b->n_contexts; ++r)
+	{
+		b->pos[r * b->max_targets + i] = 0.0;
+		b->neg[r * b->max_targets + i] = 0.0;
+	}
+	return b->n_targets++;
+}
+
+/* train_window: train the window of the central word line[pos] against
+ * shared negative samples with the learning rate alpha. Return the number of
+ * rejected negative samples and add the number of accepted ones to
+ * *negsamp_total.
+ */
+long train_window(struct batch *b, struct sampler *smp,
+                  const struct replica *h, int *line, int pos, int half_ws,
+                  float alpha, long *negsamp_total)
+{
+	int c, d, r, t, w_t, w_c, col, target, n_sp, n_wp, *sp, *wp;
+	long discarded = 0, mt = b->max_targets;
+	float s, g, *wi, *wo;
+
+	w_t = line[pos];
+	b->n_contexts = b->n_targets = 0;
+	for (c = pos - half_ws; c < pos + half_ws + 1; ++c)
+		if (c != pos)
+			b->contexts[b->n_contexts++] = line[c];
+
+	/* central word is a positive sample for all context words */
+	col = batch_target(b, w_t);
+	for (r = 0; r < b->n_contexts; ++r)
+		b->pos[r * mt + col] += 1.0;
+
+	/* negative samples are shared, but still rejected for the context
+	 * words they form a strong or a weak pair with */
+	for (d = args.negative; d--;)
+	{
+		do
+			target = draw_negative(smp);
+		while (target == w_t);
+
+		col = batch_target(b, target);
+		for (r = 0; r < b->n_contexts; ++r)
+		{
+			w_c = b->contexts[r];
+			if (has_pair(&strong, w_c, target) ||
+			    has_pair(&weak, w_c, target))
+			{
+				++discarded;
+				continue;
+			}
+
+			++*negsamp_total;
+			b->neg[r * mt + col] += 1.0;
+		}
+	}
+
+	/* strong and weak pairs of each context word */
+	for (r = 0; r < b->n_contexts; ++r)
+	{
+		w_c  = b->contexts[r];
+		sp   = strong.neighbors + strong.offsets[w_c];
+		n_sp = strong.offsets[w_c+1] - strong.offsets[w_c];
+		wp   = weak.neighbors + weak.offsets[w_c];
+		n_wp = weak.offsets[w_c+1] - weak.offsets[w_c];
+
+		for (d = args.strong_draws; n_sp > 0 && d--;)
+		{
+			target = draw_pair(&smp->pos_sp[paired[w_c]], sp, n_sp);
+			++b->pair_draws;
+			col = batch_target(b, target);
+			b->pos[r * mt + col] += args.beta_strong;
+		}
+
+		for (d = args.weak_draws; n_wp > 0 && d--;)
+		{
+			target = draw_pair(&smp->pos_wp[paired[w_c]], wp, n_wp);
+			++b->pair_draws;
+			col = batch_target(b, target);
+			b->pos[r * mt + col] += args.beta_weak;
+		}
+	}
+
+	/* forward: the gradient of each cell replaces its coefficients in
+	 * pos[][]. All gradients are computed from the weights before the
+	 * update of the window. The sigmoids of a row are evaluated at once;
+	 * cells without coefficients keep a null gradient whatever their x. */
+	for (r = 0; r < b->n_contexts; ++r)
+	{
+		wi = WI + (long) b->contexts[r] * row_size;
+		for (t = 0; t < b->n_targets; ++t)
+		{
+			b->x[t] = 0.0;
+			if (b->pos[r * mt + t] == 0.0 && b->neg[r * mt + t] == 0.0)
+				continue;
+
+			wo = out_row(h, b->targets[t]);
+			b->x[t] = kern.dot(wi, wo, args.dim);
+			++b->updates;
+		}
+
+		sigmoid_vec(b->x, b->x, b->n_targets);
+		for (t = 0; t < b->n_targets; ++t)
+		{
+			s = b->x[t];
+			b->pos[r * mt + t] = alpha * (b->pos[r * mt + t] *
+			                     (1 - s) - b->neg[r * mt + t] * s);
+		}
+	}
+
+	/* backward: contexts x targets gradients times the targets rows */
+	memset(b->dx, 0, b->n_contexts * args.dim * sizeof *b->dx);
+	for (r = 0; r < b->n_contexts; ++r)
+		for (t = 0; t < b->n_targets; ++t)
+			if ((g = b->pos[r * mt + t]) != 0.0)
+				kern.axpy(b->dx + r * args.dim,
+				          out_row(h, b->targets[t]),
+				          g, args.dim);
+
+	/* each row of WO is updated with all contexts while it is in cache */
+	for (t = 0; t < b->n_targets; ++t)
+	{
+		wo = out_row(h, b->targets[t]);
+		for (r = 0; r < b->n_contexts; ++r)
+			if ((g = b->pos[r * mt + t]) != 0.0)
+				kern.axpy(wo, WI + (long) b->contexts[r] * row_size,
+				          g, args.dim);
+	}
+
+	for (r = 0; r < b->n_contexts; ++r)
+		kern.axpy(WI + (long) b->contexts[r] * row_size,
+		          b->dx + r * args.dim, 1.0, args.dim);
+
+	return discarded;
+}
+
+/* pause_for_checkpoint: save the state of thread id in ckpt and wait until
+ * the matrices are copied */
+void pause_for_checkpoint(int id, char *cur, char *end, int rnd,
+                          long word_count_local, long negsamp_discarded,
+                          long negsamp_total, struct sampler *smp)
+{
+	struct thread_state *s = &ckpt.states[id];
+	long generation;
+
+	s->cur               = cur - input_part(0, 1);
+	s->end               = end - input_part(0, 1);
+	s->rnd               = rnd;
+	s->word_count_local  = word_count_local;
+	s->negsamp_discarded = negsamp_discarded;
+	s->negsamp_total     = negsamp_total;
+	s->rng               = smp->rng;
+	memcpy(ckpt.pos_sp + id * (n_paired + 1), smp->pos_sp,
+	       (n_paired + 1) * sizeof *smp->pos_sp);
+	memcpy(ckpt.pos_wp + id * (n_paired + 1), smp->pos_wp,
+	       (n_paired + 1) * sizeof *smp->pos_wp);
+
+	pthread_mutex_lock(&ckpt.lock);
+	generation = ckpt.generation;
+	++ckpt.stopped;
+	pthread_cond_broadcast(&ckpt.cond);
+	while (ckpt.generation == generation)
+		pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+	pthread_mutex_unlock(&ckpt.lock);
+}
+
+/* restore_thread_state: restart thread id from the state loaded with
+ * -resume */
+void restore_thread_state(int id, char **cur, char **end, int *rnd,
+                          long *word_count_local, long *negsamp_discarded,
+                          long *negsamp_total, struct sampler *smp)
+{
+	struct thread_state *s = &ckpt.states[id];
+
+	*cur               = input_part(0, 1) + s->cur;
+	*end               = input_part(0, 1) + s->end;
+	*rnd               = s->rnd;
+	*word_count_local  = s->word_count_local;
+	*negsamp_discarded = s->negsamp_discarded;
+	*negsamp_total     = s->negsamp_total;
+	smp->rng           = s->rng;
+	memcpy(smp->pos_sp, ckpt.pos_sp + id * (n_paired + 1),
+	       (n_paired + 1) * sizeof *smp->pos_sp);
+	memcpy(smp->pos_wp, ckpt.pos_wp + id * (n_paired + 1),
+	       (n_paired + 1) * sizeof *smp->pos_wp);
+}
+
+/* The training data is cut into chunks of about CHUNK_SIZE bytes starting on
+ * word boundaries. Threads claim the chunks in order with an atomic counter
+ * until none is left, so each word is trained exactly once per epoch and all
+ * threads finish the epoch at about the same time whatever their speed.
+ * With -numa 2, the chunks are split in one partition per node: threads
+ * claim the chunks of their node first, then steal from the other nodes.
+ */
+#define CHUNK_SIZE (256 * 1024)
+
+struct partition
+{
+	long first, last;  /* chunks of the partition */
+	long next;         /* next chunk to claim */
+	char pad[40];      /* one partition per cache line */
+};
+
+struct scheduler
+{
+	char **starts;   /* first word of each chunk, n + 1 cells */
+	long n;          /* number of chunks */
+	int n_parts;
+	struct partition *parts;
+} sched;
+
+/* init_scheduler: cut the training data (id cache if there is one, input
+ * file otherwise) into chunks, at least 16 per thread */
+void init_scheduler()
+{
+	long i, size;
+	int p;
+
+	size = (ids.data != NULL) ? ids.end - ids.data : file_size;
+	sched.n = size / CHUNK_SIZE;
+	if (sched.n < 16L * args.num_threads)
+		sched.n = 16L * args.num_threads;
+	sched.n_parts = (args.numa == 2) ? numa.n_nodes : 1;
+
+	sched.starts = calloc(sched.n + 1, sizeof *sched.starts);
+	sched.parts  = calloc(sched.n_parts, sizeof *sched.parts);
+	if (sched.starts == NULL || sched.parts == NULL)
+	{
+		printf("Cannot allocate memory for the chunks of the input\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sched.n; ++i)
+		sched.starts[i] = input_part(i, sched.n);
+	sched.starts[sched.n] = (ids.data != NULL) ? ids.end : corpus.end;
+
+	for (p = 0; p < sched.n_parts; ++p)
+	{
+		sched.parts[p].first = sched.n * p / sched.n_parts;
+		sched.parts[p].last  = sched.n * (p + 1) / sched.n_parts;
+	}
+}
+
+/* claim_chunk: give the next chunk of the epoch to the calling thread,
+ * taken from partition part or stolen from the next ones. Return 0 if all
+ * chunks are taken. */
+static inline int claim_chunk(int part, char **cur, char **end)
+{
+	struct partition *p;
+	long i;
+	int k;
+
+	for (k = 0; k < sched.n_parts; ++k)
+	{
+		p = &sched.parts[(part + k) % sched.n_parts];
+		if (__atomic_load_n(&p->next, __ATOMIC_RELAXED) >= p->last)
+			continue;
+
+		i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+		if (i >= p->last)
+			continue;
+
+		*cur = sched.starts[i];
+		*end = sched.starts[i+1];
+		return 1;
+	}
+
+	return 0;
+}
+
+/* With -readers R, R reader threads parse the training data (chunks of the
+ * input file or of the id cache, or blocks of the stream), look up and
+ * subsample the words, and queue blocks of PIPE_LINES sentences of indexes.
+ * The training threads only pop these blocks and compute the updates, so
+ * parsing overlaps with training instead of stopping it. The queue holds
+ * -queue-depth blocks per training thread. The time readers wait for a free
+ * block and training threads wait for a filled one is reported after each
+ * epoch: readers waiting means more training threads (or fewer readers)
+ * would help, training threads waiting means more readers are needed.
+ */
+#define PIPE_LINES 16
+
+struct sentences
+{
+	int  *ids;              /* PIPE_LINES lines of MAXLINE indexes */
+	int  lens[PIPE_LINES];  /* indexes in each line */
+	int  n_lines;
+	long words;             /* words read for the block, discarded or not */
+};
+
+struct pipeline
+{
+	struct sentences *blocks;
+	struct queue q;
+	pthread_t *readers;
+} pipeline;
+
+/* init_pipeline: allocate the blocks of sentences and the reader threads */
+void init_pipeline()
+{
+	int i, n = args.queue_depth * args.num_threads;
+
+	init_queue(&pipeline.q, n);
+	pipeline.blocks  = calloc(n, sizeof *pipeline.blocks);
+	pipeline.readers = calloc(args.readers, sizeof *pipeline.readers);
+	if (pipeline.blocks == NULL || pipeline.readers == NULL)
+	{
+		printf("Cannot allocate memory for the reader threads\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; ++i)
+		if ((pipeline.blocks[i].ids = malloc(PIPE_LINES * MAXLINE *
+		     sizeof *pipeline.blocks[i].ids)) == NULL)
+		{
+			printf("Cannot allocate memory for the reader threads\n");
+			exit(1);
+		}
+}
+
+/* destroy_pipeline: free the blocks of sentences */
+void destroy_pipeline()
+{
+	int i;
+
+	for (i = 0; i < pipeline.q.n; ++i)
+		free(pipeline.blocks[i].ids);
+	free(pipeline.blocks);
+	free(pipeline.readers);
+	destroy_queue(&pipeline.q);
+}
+
+/* parse_thread: fill blocks of sentences with the words of the chunks (or
+ * stream blocks) claimed by the reader id, until none is left. Lines are cut
+ * as in train_epoch(): MAXLINE words read, before subsampling. */
+void *parse_thread(void *id)
+{
+	struct sentences *s = NULL;
+	char *cur = NULL, *end = NULL;
+	int r = (intptr_t) id, rnd = args.num_threads + r, slot = -1;
+	int part = stream.on ? 0 : r % sched.n_parts;
+	int i = 0, k, w_t, *line;
+
+	for (;;)
+	{
+		if (cur >= end && !(stream.on ?
+		    claim_block(&slot, &cur, &end) :
+		    claim_chunk(part, &cur, &end)))
+			break;
+
+		if (s == NULL)
+		{
+			i = queue_get_free(&pipeline.q);
+			s = &pipeline.blocks[i];
+			s->n_lines = 0;
+			s->words   = 0;
+		}
+
+		line = s->ids + s->n_lines * MAXLINE;
+		s->lens[s->n_lines] = 0;
+		for (k = MAXLINE; k--;)
+		{
+			if ((w_t = next_word(&cur, end)) == -2)
+			{
+				cur = end;
+				break;
+			}
+			if (w_t == -1)
+				continue;
+
+			++s->words;
+			rnd = rnd * 1103515245 + 12345;
+			if (pdiscard[w_t] >= (rnd & 0xFFFF) / 65536.0)
+				line[s->lens[s->n_lines]++] = w_t;
+		}
+
+		if (++s->n_lines == PIPE_LINES)
+		{
+			queue_push(&pipeline.q, i);
+			s = NULL;
+		}
+	}
+
+	if (s != NULL)
+		queue_push(&pipeline.q, i);
+	queue_done(&pipeline.q);
+	return NULL;
+}
+
+/* start_readers: start the reader threads of an epoch */
+void start_readers()
+{
+	int i;
+
+	pipeline.q.full_wait = pipeline.q.empty_wait = 0;
+	reset_queue(&pipeline.q, args.readers);
+	for (i = 0; i < args.readers; ++i)
+		pthread_create(&pipeline.readers[i], NULL, parse_thread,
+		               (void *) (intptr_t) i);
+}
+
+/* stop_readers: wait for the reader threads and report the queue stalls */
+void stop_readers()
+{
+	int i;
+
+	for (i = 0; i < args.readers; ++i)
+		pthread_join(pipeline.readers[i], NULL);
+
+	printf("\nQueue stalls: readers %.2fs (queue full), training threads "
+	       "%.2fs (queue empty)", pipeline.q.full_wait,
+	       pipeline.q.empty_wait);
+	if (metrics.out != NULL)
+	{
+		fprintf(metrics.out, "{\"type\":\"queue\",\"time\":%.3f,"
+		        "\"epoch\":%d,\"readers\":%d,\"depth\":%d,"
+		        "\"full_wait\":%.3f,\"empty_wait\":%.3f}\n",
+		        wall_time() - metrics.begin, current_epoch + 1,
+		        args.readers, pipeline.q.n, pipeline.q.full_wait,
+		        pipeline.q.empty_wait);
+		fflush(metrics.out);
+	}
+}
+
+/* Training threads are created once and live for the whole run. Their
+ * buffers (hidden vector, sampler cursors, batch of -shared-negatives) are
+ * allocated once, and their sampler is seeded once: its generator and
+ * cursors are not reset between epochs. Epochs are started and ended by two barriers shared with
+ * the main thread, which saves the vectors and checkpoints between them.
+ * With -pin 1, worker i runs on the i-th CPU available to the process (or
+ * to its node with -numa).
+ */
+struct worker
+{
+	float *hidden;
+	struct sampler smp;
+	struct batch batch;
+	struct replica hot;
+};
+
+struct pool
+{
+	pthread_t *threads;
+	long *words;               /* words read by each thread in the epoch */
+	long *updates;             /* dot products of each thread */
+	pthread_barrier_t start;   /* workers and main, before an epoch */
+	pthread_barrier_t end;     /* workers and main, after an epoch */
+	int quit;                  /* set before the last start barrier */
+} pool;
+
+/* train_epoch: train the epoch current_epoch in the worker thread_id */
+void train_epoch(int thread_id, struct worker *wk)
+{
+	char *cur, *end;
+	int w_t, w_c, c, d, target, line_size, pos, line_buf[MAXLINE];
+	int k, half_ws, n_sp, n_wp, *sp, *wp, *line = line_buf, n_line = 0;
+	long index1, word_count_local, negsamp_discarded, negsamp_total;
+	long words_done, words = 0, updates = 0, pair_draws = 0;
+	float label, dot_prod, grad, alpha, *wo, *hidden = wk->hidden;
+	double progress, wts, discarded, d_train, lr_coef;
+	struct batch *batch = &wk->batch;
+	struct sampler *smp = &wk->smp;
+	struct replica *hot = &wk->hot;
+	struct counters *cnt = &metrics.threads[thread_id], base = *cnt;
+	struct sentences *block = NULL;
+
+	int rnd = thread_id, slot = -1;
+	int part = (sched.n_parts > 1) ? node_of_thread(thread_id) : 0;
+
+	/* init variables. The first chunk is claimed in the loop */
+	cur = end = NULL;
+	word_count_local = negsamp_discarded = negsamp_total = 0;
+	half_ws          = args.window / 2;
+	wts = discarded  = 0.0f;
+	d_train          = 1.0f / train_words;
+	lr_coef          = args.starting_alpha / ((double) (args.epoch * train_words));
+	if (ckpt.resume)
+		restore_thread_state(thread_id, &cur, &end, &rnd,
+		                     &word_count_local, &negsamp_discarded,
+		                     &negsamp_total, smp);
+	if (args.hot_rows)
+		load_replica(hot);
+
+	/* word_count_actual is shared by all threads. It must be read and
+	 * updated atomically, otherwise the compiler is free to keep a stale
+	 * copy of it in a register. The learning rate is derived from it
+	 * instead of being decremented by each thread, and stored atomically
+	 * as well. Words/thread/sec is measured on the wall clock, since
+	 * clock() sums the CPU time of all threads. The epoch ends when
+	 * all chunks are trained. */
+	for (;;)
+	{
+		/* stop here while a checkpoint copies the matrices, with the
+		 * hot rows merged in WO */
+		if (__atomic_load_n(&ckpt.request, __ATOMIC_ACQUIRE))
+		{
+			if (args.hot_rows)
+				merge_replica(hot);
+			pause_for_checkpoint(thread_id, cur, end, rnd,
+			                     word_count_local, negsamp_discarded,
+			                     negsamp_total, smp);
+		}
+
+		/* with -readers, lines come already read from the queue */
+		if (args.readers)
+		{
+			while ((block == NULL || n_line == block->n_lines) &&
+			       queue_pop(&pipeline.q, &slot))
+			{
+				block = &pipeline.blocks[slot];
+				word_count_local += block->words;
+				n_line = 0;
+			}
+			if (slot == -1)
+				break;
+		}
+		else if (cur >= end && !(stream.on ?
+		         claim_block(&slot, &cur, &end) :
+		         claim_chunk(part, &cur, &end)))
+			break;
+
+		/* update learning rate and print progress */
+		if (word_count_local > 20000)
+		{
+			words_done = __atomic_add_fetch(&word_count_actual,
+			             word_count_local, __ATOMIC_RELAXED);
+			alpha = args.starting_alpha - words_done * lr_coef;
+			__atomic_store(&args.alpha, &alpha, __ATOMIC_RELAXED);
+			words += word_count_local;
+			word_count_local = 0;
+			publish_counters(cnt, &base, words, negsamp_total,
+			                 negsamp_discarded,
+			                 pair_draws + batch->pair_draws);
+
+			/* "Discarded" is the percentage of discarded negative
+			 * samples because they form either a strong or a weak
+			 * pair with context word */
+			progress = words_done * d_train * 100;
+			progress -= 100 * current_epoch;
+			wts = (words_done - start_words) / ((wall_time() - start) *
+			      1000.0 * args.num_threads);
+			discarded = negsamp_discarded * 100.0 / negsamp_total;
+			printf("%clr: %f  Progress: %.2f%%  Words/thread/sec:"
+			       " %.2fk  Discarded: %.2f%% ",
+			       13, alpha, progress, wts, discarded);
+			fflush(stdout);
+		}
+
+		/* read MAXLINE words from the chunk. Add words in line[] if
+		 * they are in vocabulary and not discarded. So length of line
+		 * might be less than MAXLINE (in practice, length of line is
+		 * 500 +/- 50, less at the end of a chunk. */
+		line_size = 0;
+		if (args.readers)
+		{
+			line      = block->ids + n_line * MAXLINE;
+			line_size = block->lens[n_line++];
+		}
+		else for (k = MAXLINE; k--;)
+		{
+			/* words are hashed in place, without any copy */
+			if ((w_t = next_word(&cur, end)) == -2)
+			{
+				cur = end;
+				break;
+			}
+
+			/* word is not in vocabulary, move to next one */
+			if (w_t == -1)
+				continue;
+
+			/* we processed one more word */
+			++word_count_local;
+
+			/* discard word or add it in the sentence */
+			rnd = rnd * 1103515245 + 12345;
+			if (pdiscard[w_t] < (rnd & 0xFFFF) / 65536.0)
+				continue;
+			else
+				line[line_size++] = w_t;
+		}
+
+		/* the learning rate is written by all threads, read it once
+		 * per line */
+		__atomic_load(&args.alpha, &alpha, __ATOMIC_RELAXED);
+
+		/* for each word of the line */
+		for (pos = half_ws; pos < line_size - half_ws; ++pos)
+		{
+			/* train the whole window at once */
+			if (args.shared_negatives)
+			{
+				negsamp_discarded += train_window(batch, smp,
+				                     hot, line, pos, half_ws, alpha,
+				                     &negsamp_total);
+				continue;
+			}
+
+			w_t = line[pos];  /* central word */
+
+			/* for each word of the context window */
+			for (c = pos - half_ws; c < pos + half_ws +1; ++c)
+			{
+				if (c == pos)
+					continue;
+
+				w_c = line[c];
+				index1 = w_c * row_size;
+
+				/* strong and weak pairs of context word */
+				sp   = strong.neighbors + strong.offsets[w_c];
+				n_sp = strong.offsets[w_c+1] - strong.offsets[w_c];
+				wp   = weak.neighbors + weak.offsets[w_c];
+				n_wp = weak.offsets[w_c+1] - weak.offsets[w_c];
+
+				/* zero the hidden vector */
+				memset(hidden, 0.0, args.dim * sizeof *hidden);
+
+				/* STANDARD AND NEGATIVE SAMPLING UPDATE */
+				for (d = args.negative+1; d--;)
+				{
+					/* target is central word */
+					if (d == 0)
+					{
+						target = w_t;
+						label = 1.0;
+					}
+
+					/* target is random word */
+					else
+					{
+						do
+							target = draw_negative(smp);
+						while (target == w_t);
+
+						/* if random word form a strong a weak pair
+						 with w_c, move to next one */
+						if (has_pair(&strong, w_c, target) ||
+						    has_pair(&weak, w_c, target))
+						{
+							++negsamp_discarded;
+							continue;
+						}
+
+						++negsamp_total;
+						label = 0.0;
+					}
+
+
+					/* forward propagation */
+					wo = out_row(hot, target);
+					dot_prod = kern.dot(WI + index1, wo, args.dim);
+					++updates;
+
+					grad = alpha * (label - sigmoid(dot_prod));
+
+					/* back-propagation. hidden and WO are
+					 updated in the same pass over the
+					 rows by the SIMD kernel. */
+					kern.backprop(hidden, wo, WI + index1, grad,
+					              args.dim);
+				}
+
+				/* POSITIVE SAMPLING UPDATE (strong pairs) */
+				for (d = args.strong_draws; d--;)
+				{
+					/* can't do anything if no strong pairs
+					 */
+					if (n_sp == 0)
+						break;
+
+					target = draw_pair(&smp->pos_sp[paired[w_c]],
+					                   sp, n_sp);
+					++pair_draws;
+
+					wo = out_row(hot, target);
+					dot_prod = kern.dot(WI + index1, wo, args.dim);
+					++updates;
+
+					grad = alpha * args.beta_strong *
+					       (1 - sigmoid(dot_prod));
+
+					/* dot product is already high, nothing to do */
+					if (grad == 0.0)
+						continue;
+
+					kern.backprop(hidden, wo, WI + index1, grad,
+					              args.dim);
+				}
+
+				/* POSITIVE SAMPLING UPDATE (weak pairs) */
+				for (d = args.weak_draws; d--;)
+				{
+					/* can't do anything if no weak pairs */
+					if (n_wp == 0)
+						break;
+
+					target = draw_pair(&smp->pos_wp[paired[w_c]],
+					                   wp, n_wp);
+					++pair_draws;
+
+					wo = out_row(hot, target);
+					dot_prod = kern.dot(WI + index1, wo, args.dim);
+					++updates;
+
+					grad = alpha * args.beta_weak *
+					       (1 - sigmoid(dot_prod));
+					if (grad == 0.0)
+						continue;
+
+					kern.backprop(hidden, wo, WI + index1, grad,
+					              args.dim);
+				}
+
+				/* Back-propagate hidden -> input */
+				kern.axpy(WI + index1, hidden, 1.0, args.dim);
+
+			} /* end for each word in the context window */
+
+		}     /* end for each word in line */
+
+		if (args.hot_rows && (hot->words += line_size) >= args.hot_sync)
+			merge_replica(hot);
+	}         /* end while() loop for reading file */
+
+	if (args.hot_rows)
+		merge_replica(hot);
+
+	__atomic_add_fetch(&word_count_actual, word_count_local,
+	                   __ATOMIC_RELAXED);
+	pool.words[thread_id]   = words + word_count_local;
+	pool.updates[thread_id] = updates + batch->updates;
+	publish_counters(cnt, &base, words + word_count_local, negsamp_total,
+	                 negsamp_discarded, pair_draws + batch->pair_draws);
+	batch->updates = batch->pair_draws = 0;
+	__atomic_add_fetch(&negsamp_rejected, negsamp_discarded,
+	                   __ATOMIC_RELAXED);
+
+	/* sometimes, progress go over 100% because of rounding float error.
+	print a proper 100% progress */
+	__atomic_load(&args.alpha, &alpha, __ATOMIC_RELAXED);
+	if (alpha < 0)
+	{
+		alpha = 0;
+		__atomic_store(&args.alpha, &alpha, __ATOMIC_RELAXED);
+	}
+	printf("%clr: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  Discarded:"
+	       " %.2f%% ", 13, alpha, 100.0, wts, discarded);
+	fflush(stdout);
+
+	/* a checkpoint must not wait for this thread anymore, nor restart
+	 * it from an older state */
+	pthread_mutex_lock(&ckpt.lock);
+	if (ckpt.states != NULL)
+		memset(&ckpt.states[thread_id], 0, sizeof *ckpt.states);
+	--ckpt.running;
+	pthread_cond_broadcast(&ckpt.cond);
+	pthread_mutex_unlock(&ckpt.lock);
+}
+
+/* pin_thread: run the calling thread i on its NUMA node with -numa, and on
+ * the i-th CPU available (on its node) with -pin */
+void pin_thread(int i)
+{
+	cpu_set_t allowed, cpu;
+	int c, n, node;
+
+	if (args.numa)
+	{
+		/* rank of the thread among the threads of its node */
+		node = node_of_thread(i);
+		for (n = i; n > 0 && node_of_thread(n - 1) == node; --n)
+			continue;
+		i -= n;
+
+		allowed = numa.cpus[node];
+		if (!args.pin)
+		{
+			pthread_setaffinity_np(pthread_self(), sizeof allowed,
+			                       &allowed);
+			return;
+		}
+	}
+	else if (sched_getaffinity(0, sizeof allowed, &allowed) != 0 ||
+	         CPU_COUNT(&allowed) == 0)
+		return;
+
+	i %= CPU_COUNT(&allowed);
+	for (c = 0, n = 0; c < CPU_SETSIZE; ++c)
+		if (CPU_ISSET(c, &allowed) && n++ == i)
+			break;
+
+	CPU_ZERO(&cpu);
+	CPU_SET(c, &cpu);
+	if (pthread_setaffinity_np(pthread_self(), sizeof cpu, &cpu) != 0)
+		printf("WARNING: cannot pin thread %d on CPU %d\n", i, c);
+}
+
+/* worker_thread: allocate the buffers of a worker and seed its sampler, then
+ * train each epoch started by the main thread */
+void *worker_thread(void *id)
+{
+	struct worker wk;
+	int thread_id = (intptr_t) id;
+
+	memset(&wk, 0, sizeof wk);
+	if (args.pin || args.numa)
+		pin_thread(thread_id);
+
+	if ((wk.hidden = calloc(args.dim, sizeof *wk.hidden)) == NULL)
+	{
+		printf("Cannot allocate memory for the hidden layer\n");
+		exit(1);
+	}
+	init_sampler(&wk.smp);
+	seed_sampler(&wk.smp, thread_id);
+	if (args.shared_negatives)
+		init_batch(&wk.batch);
+	init_replica(&wk.hot);
+
+	for (;;)
+	{
+		pthread_barrier_wait(&pool.start);
+		if (pool.quit)
+			break;
+		train_epoch(thread_id, &wk);
+		pthread_barrier_wait(&pool.end);
+	}
+
+	if (args.shared_negatives)
+		destroy_batch(&wk.batch);
+	destroy_replica(&wk.hot);
+	destroy_sampler(&wk.smp);
+	free(wk.hidden);
+	return NULL;
+}
+
+
+/* Embeddings are saved in one of 3 formats (-binary option):
+ *   0  text, one word per line followed by its values with 3 decimals (.vec)
+ *   1  word2vec binary: "<words> <dim>\n" then for each word, the word, a
+ *      space, dim raw floats and "\n" (.bin)
+ *   2  native format meant to be mapped in memory (.d2v): a struct
+ *      vec_header, the offsets of the words (vocab_size+1 uint64), the
+ *      words ended by '\0', then the vocab_size x dim floats of all vectors
+ *      in one block starting on a VEC_ALIGN boundary. Words are sorted by
+ *      decreasing count, as in the vocabulary. Integers and floats are
+ *      stored in the byte order of the machine (little endian on x86).
+ *
+ * With -quantize, a second native file holds the vectors in a smaller type
+ * (see save_quantized()); only the type and the vectors block change.
+ */
+#define VEC_ALIGN  4096
+#define SAVE_BLOCK 1024   /* words formatted by a thread in a text round */
+
+/* types of the vectors block of a native file */
+enum { VEC_FLOAT32 = 1, VEC_FLOAT16, VEC_INT8, VEC_PQ };
+
+struct vec_header
+{
+	char     magic[4];        /* "D2VE" */
+	uint32_t type;            /* VEC_FLOAT32, VEC_FLOAT16, VEC_INT8, VEC_PQ */
+	uint64_t vocab_size;
+	uint64_t dim;
+	uint64_t index_offset;    /* offset of the word offsets */
+	uint64_t words_offset;    /* offset of the words */
+	uint64_t vectors_offset;  /* offset of the vectors, VEC_ALIGN aligned */
+};
+
+struct save_job
+{
+	long  first, last;  /* range of words formatted by the thread */
+	char  *buf;
+	long  size, max_size;
+};
+
+/* format_value: write x with 3 decimals and a space at p like "%.3f ", return
+ * the number of characters written. x * 1000 is exact in double precision,
+ * so rounding it to the nearest integer rounds x like printf does. The sign,
+ * infinities and NaN are read from the bits of x since -Ofast assumes there
+ * are no signed zeros nor NaN.
+ */
+static inline int format_value(char *p, float x)
+{
+	char digits[24], *q = p;
+	uint32_t bits;
+	long v;
+	int n = 0;
+
+	memcpy(&bits, &x, sizeof bits);
+
+	/* |x| >= 2^39, infinities and NaN */
+	if ((bits & 0x7fffffff) >= (127u + 39) << 23)
+		return sprintf(p, "%.3f ", x);
+
+	if (bits >> 31)
+		*q++ = '-';
+	v = llrint(fabs((double) x) * 1000);
+
+	/* at least 4 digits: 0.xxx */
+	do
+	{
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0 || n < 4);
+
+	while (n > 3)
+		*q++ = digits[--n];
+	*q++ = '.';
+	while (n > 0)
+		*q++ = digits[--n];
+	*q++ = ' ';
+
+	return q - p;
+}
+
+/* format_thread: format the words of a save_job in its buffer as text */
+void *format_thread(void *p)
 {
-	FILE *fi;
-	int i, failure_strong, failure_weak;
-	char word[MAXLEN];
+	struct save_job *job = p;
+	long i, needed;
+	int j;
+
+	job->size = 0;
+	for (i = job->first; i < job->last; ++i)
+	{
+		/* a value takes at most 49 characters ("-FLT_MAX.000 ") */
+		needed = job->size + strlen(vocab_word(i)) + 2 + 49L * args.dim;
+		if (needed > job->max_size)
+		{
+			job->max_size = 2 * needed;
+			if ((job->buf = realloc(job->buf, job->max_size)) == NULL)
+			{
+				printf("Cannot allocate memory to save vectors\n");
+				exit(1);
+			}
+		}
+
+		job->size += sprintf(job->buf + job->size, "%s ", vocab_word(i));
+		for (j = 0; j < args.dim; j++)
+			job->size += format_value(job->buf + job->size,
+			                          WI[i * row_size + j]);
+		job->buf[job->size++] = '\n';
+	}
+
+	return NULL;
+}
 
-	if ((fi = fopen(input_fn, "r")) == NULL)
+/* write_text: write the vectors as text. Threads format blocks of
+ * consecutive words in parallel, which are written in order. */
+void write_text(FILE *fo)
+{
+	struct save_job *jobs;
+	pthread_t *threads;
+	long first;
+	int i, n = args.num_threads;
+
+	jobs    = calloc(n, sizeof *jobs);
+	threads = calloc(n, sizeof *threads);
+	if (jobs == NULL || threads == NULL)
 	{
-		printf("ERROR: training data file not found!\n");
+		printf("Cannot allocate memory to save vectors\n");
 		exit(1);
 	}
 
-	/* init the hash table with -1 */
-	for (i = 0; i < HASHSIZE; ++i)
-		vocab_hash[i] = -1;
+	/* first line is number of vectors + dimension */
+	fprintf(fo, "%ld %d\n", vocab_size, args.dim);
 
-	/* some words are longer than MAXLEN, need to indicate a maximum width
-	 * to scanf so no buffer overflow. */
-	while ((fscanf(fi, "%100s", word) != EOF))
+	for (first = 0; first < vocab_size; first += (long) n * SAVE_BLOCK)
 	{
-		/* increment total number of read words */
-		train_words++;
-		if (train_words % 500000 == 0)
+		for (i = 0; i < n; ++i)
 		{
-			printf("%ldK%c", train_words / 1000, 13);
-			fflush(stdout);
+			jobs[i].first = first + (long) i * SAVE_BLOCK;
+			jobs[i].last  = jobs[i].first + SAVE_BLOCK;
+			if (jobs[i].first > vocab_size)
+				jobs[i].first = vocab_size;
+			if (jobs[i].last > vocab_size)
+				jobs[i].last = vocab_size;
+			pthread_create(&threads[i], NULL, format_thread, &jobs[i]);
+		}
+
+		for (i = 0; i < n; ++i)
+		{
+			pthread_join(threads[i], NULL);
+			fwrite(jobs[i].buf, 1, jobs[i].size, fo);
 		}
+	}
+
+	for (i = 0; i < n; ++i)
+		free(jobs[i].buf);
+	free(threads);
+	free(jobs);
+}
+
+/* write_word2vec: write the vectors in the binary format of word2vec */
+void write_word2vec(FILE *fo)
+{
+	long i;
 
-		/* add word we just read or increment its count if needed */
-		add_word(word);
+	fprintf(fo, "%ld %d\n", vocab_size, args.dim);
+	for (i = 0; i < vocab_size; i++)
+	{
+		fprintf(fo, "%s ", vocab_word(i));
+		fwrite(WI + i * row_size, sizeof *WI, args.dim, fo);
+		fputc('\n', fo);
+	}
+}
+
+/* write_native_header: write the native format of fo up to the vectors
+ * block, which has the given type. */
+void write_native_header(FILE *fo, uint32_t type)
+{
+	struct vec_header header;
+	uint64_t *offsets;
+	long i, pos;
 
-		/* Wikipedia has around 8M unique words, so we never hit the
-		 * 21M words limit and therefore never need to reduce the vocab
-		 * during creation of vocabulary. If your input file contains
-		 * much more unique words, you might need to uncomment it. */
-		/*if (vocab_size > HASHSIZE * 0.7)
-			sort_and_reduce_vocab();*/
+	if ((offsets = calloc(vocab_size + 1, sizeof *offsets)) == NULL)
+	{
+		printf("Cannot allocate memory to save vectors\n");
+		exit(1);
 	}
 
-	sort_and_reduce_vocab(HASHSIZE);
+	for (i = 0; i < vocab_size; ++i)
+		offsets[i+1] = offsets[i] + strlen(vocab_word(i)) + 1;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, "D2VE", 4);
+	header.type           = type;
+	header.vocab_size     = vocab_size;
+	header.dim            = args.dim;
+	header.index_offset   = sizeof header;
+	header.words_offset   = header.index_offset +
+	                        (vocab_size + 1) * sizeof *offsets;
+	header.vectors_offset = (header.words_offset + offsets[vocab_size] +
+	                         VEC_ALIGN - 1) / VEC_ALIGN * VEC_ALIGN;
+
+	fwrite(&header, sizeof header, 1, fo);
+	fwrite(offsets, sizeof *offsets, vocab_size + 1, fo);
+	for (i = 0; i < vocab_size; ++i)
+		fwrite(vocab_word(i), 1, offsets[i+1] - offsets[i], fo);
 
-	printf("Vocab size: %ld\n", vocab_size);
-	printf("Words in train file: %ld\n", train_words);
+	/* padding up to the vectors */
+	for (pos = header.words_offset + offsets[vocab_size];
+	     pos < (long) header.vectors_offset; ++pos)
+		fputc('\0', fo);
 
-	printf("Adding strong pairs...");
-	failure_strong = read_strong_pairs(strong_fn);
-	printf("\nAdding weak pairs...");
-	failure_weak = read_weak_pairs(weak_fn);
-	if (!failure_strong || !failure_weak)
-		printf("\nAdding pairs done.\n");
+	free(offsets);
+}
 
-	/* compute the discard probability for each word (only if we
-	 * subsample)*/
-	if (args.sample > 0)
-		compute_discard_prob();
+/* write_rows: write the rows of matrix m without their padding */
+void write_rows(FILE *fo, const float *m)
+{
+	long i;
 
-	/* each thread is assigned a part of the input file. To distribute
-	 the work to each thread, we need to know the total size of the file */
-	file_size = ftell(fi);
-	fclose(fi);
+	for (i = 0; i < vocab_size; ++i)
+		fwrite(m + i * row_size, sizeof *m, args.dim, fo);
 }
 
-/* init_network: initialize matrix WI (random values) and WO (zero values) */
-void init_network()
+/* write_native: write the vectors in the native format */
+void write_native(FILE *fo)
 {
-	float r, l;
-	int i, j;
+	write_native_header(fo, VEC_FLOAT32);
+	write_rows(fo, WI);
+}
+
+/* Quantized exports (-quantize option) replace the float32 block of the
+ * native format by:
+ *   fp16  vocab_size x dim IEEE half floats
+ *   int8  vocab_size float scales, then vocab_size x dim int8. A value is
+ *         scale * q, the scale of a row being max(|x|) / 127
+ *   pq    product quantization: dim is split into m subspaces of dsub values,
+ *         each one quantized with its own codebook of ksub centroids. The
+ *         block holds m and ksub (uint32), the m x ksub x dsub float
+ *         centroids, then vocab_size x m uint8 codes. Without -pq-m, m is
+ *         the divisor of dim nearest to dim/4; a dim without any divisor
+ *         giving subspaces of PQ_MIN_DSUB to PQ_MAX_DSUB values (a prime
+ *         dim, for instance) needs -pq-m
+ * After quantization, the relative reconstruction error and the change of
+ * the cosine similarities of the strong and weak pairs (or of random pairs
+ * without pair files) are printed, the Spearman correlation between the
+ * cosines before and after being what similarity benchmarks lose.
+ */
+#define PQ_KSUB      256     /* centroids per subspace, codes are 1 byte */
+#define PQ_ITER      25      /* iterations of k-means */
+#define PQ_SAMPLE    256     /* max training vectors per centroid */
+#define PQ_MIN_DSUB  2       /* min values per subspace without -pq-m */
+#define PQ_MAX_DSUB  8       /* max values per subspace without -pq-m */
+#define QUANT_PAIRS  100000  /* max pairs used to measure the quality */
+
+struct quantized
+{
+	int      type;
+	uint16_t *half;       /* fp16 */
+	float    *scales;     /* int8 */
+	int8_t   *bytes;
+	int      m, ksub, dsub;  /* pq */
+	float    *centroids;
+	uint8_t  *codes;
+	long     *sample;     /* rows used to train the codebooks */
+	long     n_sample;
+};
+
+struct pq_job
+{
+	struct quantized *q;
+	int first, step;      /* subspaces first, first+step, ... */
+	uint64_t seed;
+};
+
+/* float_to_half: round f to the nearest IEEE half float (ties to even) */
+static uint16_t float_to_half(float f)
+{
+	uint32_t x, sign, mant;
+	int exp;
+
+	memcpy(&x, &f, sizeof x);
+	sign = (x >> 16) & 0x8000;
+	exp  = ((x >> 23) & 0xff) - 127 + 15;
+	mant = x & 0x7fffff;
+
+	/* infinities and NaN */
+	if (((x >> 23) & 0xff) == 0xff)
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+	/* too large: infinity */
+	if (exp >= 31)
+		return sign | 0x7c00;
+
+	/* subnormal or zero */
+	if (exp <= 0)
+	{
+		if (exp < -10)
+			return sign;
+		mant |= 0x800000;
+		x = mant >> (14 - exp);
+		/* round to nearest even on the shifted bits */
+		mant &= (1u << (14 - exp)) - 1;
+		if (mant > (1u << (13 - exp)) ||
+		    (mant == (1u << (13 - exp)) && (x & 1)))
+			++x;
+		return sign | x;
+	}
+
+	x = (exp << 10) | (mant >> 13);
+	mant &= 0x1fff;
+	if (mant > 0x1000 || (mant == 0x1000 && (x & 1)))
+		++x;   /* may carry into the exponent, up to infinity */
+	return sign | x;
+}
+
+/* half_to_float: convert the IEEE half float h */
+static float half_to_float(uint16_t h)
+{
+	uint32_t sign = (uint32_t) (h & 0x8000) << 16, exp = (h >> 10) & 0x1f,
+	         mant = h & 0x3ff, x;
+	float f;
+
+	if (exp == 0x1f)
+		x = sign | 0x7f800000 | (mant << 13);
+	else if (exp)
+		x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+	else if (mant == 0)
+		x = sign;
+	else
+	{
+		/* subnormal, normalized in float */
+		f = mant * (1.0f / (1 << 24));
+		memcpy(&x, &f, sizeof x);
+		x |= sign;
+	}
+
+	memcpy(&f, &x, sizeof f);
+	return f;
+}
+
+/* pq_subspaces: return the number of subspaces of -quantize pq, -pq-m or
+ * the divisor of -size nearest to size/4 (by ratio, so a size of 74 gets 37
+ * subspaces of 2 values rather than 2 of 37). Exit if it does not divide
+ * -size, or if the default gives subspaces of less than PQ_MIN_DSUB values
+ * (no smaller than int8) or more than PQ_MAX_DSUB (too coarse).
+ */
+int pq_subspaces()
+{
+	double target = args.dim / 4.0, r, best = INFINITY;
+	int m, best_m = 1;
+
+	if (args.pq_m > 0)
+	{
+		if (args.dim % args.pq_m != 0)
+		{
+			printf("ERROR: -pq-m %d does not divide -size %d\n",
+			       args.pq_m, args.dim);
+			exit(1);
+		}
+		return args.pq_m;
+	}
+
+	/* on ties, more subspaces of fewer values */
+	for (m = 1; m <= args.dim; ++m)
+	{
+		if (args.dim % m != 0)
+			continue;
+		r = (m > target) ? m / target : target / m;
+		if (r <= best)
+		{
+			best   = r;
+			best_m = m;
+		}
+	}
 
-	if ((WI = malloc(sizeof *WI * vocab_size * args.dim)) == NULL)
+	if (args.dim / best_m > PQ_MAX_DSUB ||
+	    (args.dim / best_m < PQ_MIN_DSUB && args.dim >= PQ_MIN_DSUB))
 	{
-		printf("Memory allocation failed for WI\n");
+		printf("ERROR: -size %d can not be split in subspaces of about "
+		       "4 values, choose their number with -pq-m\n", args.dim);
 		exit(1);
 	}
+	return best_m;
+}
+
+/* pq_nearest: return the centroid of subspace s of q nearest to x */
+static int pq_nearest(struct quantized *q, int s, const float *x)
+{
+	const float *c = q->centroids + (long) s * q->ksub * q->dsub;
+	float d, best = INFINITY, diff;
+	int k, j, arg = 0;
+
+	for (k = 0; k < q->ksub; ++k, c += q->dsub)
+	{
+		for (d = 0, j = 0; j < q->dsub; ++j)
+		{
+			diff = x[j] - c[j];
+			d += diff * diff;
+		}
+		if (d < best)
+		{
+			best = d;
+			arg  = k;
+		}
+	}
 
+	return arg;
+}
 
-	if ((WO = calloc(vocab_size * args.dim, sizeof *WO)) == NULL)
+/* pq_thread: train the codebooks of the subspaces of a pq_job with k-means
+ * on the sample rows, then encode all rows in these subspaces */
+void *pq_thread(void *arg)
+{
+	struct pq_job *job = arg;
+	struct quantized *q = job->q;
+	struct sampler smp = { .rng = job->seed };
+	float *c, *sums, *x;
+	int s, k, j, it, *assign;
+	long i, *counts;
+
+	sums   = calloc((long) q->ksub * q->dsub, sizeof *sums);
+	counts = calloc(q->ksub, sizeof *counts);
+	assign = calloc(q->n_sample, sizeof *assign);
+	if (sums == NULL || counts == NULL || assign == NULL)
 	{
-		printf("Memory allocation failed for WO\n");
+		printf("Cannot allocate memory for product quantization\n");
 		exit(1);
 	}
 
-	/* WI is initialized with random values from (-0.5 / vec_dimension)
-	 * and (0.5 / vec_dimension). Multiply is faster than divide so
-	 * precompute 1 / RAND_MAX and 1 / dim. */
-	r = 1.0 / RAND_MAX;
-	l = 1.0 / args.dim;
+	for (s = job->first; s < q->m; s += job->step)
+	{
+		c = q->centroids + (long) s * q->ksub * q->dsub;
+
+		/* start from the first sampled rows, which are random */
+		for (k = 0; k < q->ksub; ++k)
+			memcpy(c + k * q->dsub,
+			       WI + q->sample[k] * row_size + s * q->dsub,
+			       q->dsub * sizeof *c);
+
+		for (it = 0; it < PQ_ITER; ++it)
+		{
+			memset(sums, 0, (long) q->ksub * q->dsub * sizeof *sums);
+			memset(counts, 0, q->ksub * sizeof *counts);
+
+			for (i = 0; i < q->n_sample; ++i)
+			{
+				x = WI + q->sample[i] * row_size + s * q->dsub;
+				assign[i] = k = pq_nearest(q, s, x);
+				++counts[k];
+				for (j = 0; j < q->dsub; ++j)
+					sums[k * q->dsub + j] += x[j];
+			}
+
+			/* empty clusters restart from a random sampled row */
+			for (k = 0; k < q->ksub; ++k)
+				if (counts[k] == 0)
+				{
+					i = next_random(&smp) % q->n_sample;
+					x = WI + q->sample[i] * row_size +
+					    s * q->dsub;
+					memcpy(c + k * q->dsub, x,
+					       q->dsub * sizeof *c);
+				}
+				else
+					for (j = 0; j < q->dsub; ++j)
+						c[k * q->dsub + j] =
+						    sums[k * q->dsub + j] /
+						    counts[k];
+		}
+
+		for (i = 0; i < vocab_size; ++i)
+			q->codes[i * q->m + s] = pq_nearest(q, s,
+			        WI + i * row_size + s * q->dsub);
+	}
+
+	free(assign);
+	free(counts);
+	free(sums);
+	return NULL;
+}
+
+/* quantize_pq: build the codebooks and codes of q with -threads threads,
+ * each one handling a subset of the subspaces */
+void quantize_pq(struct quantized *q)
+{
+	struct sampler smp = { .rng = 0x9E3779B97F4A7C15ULL };
+	struct pq_job *jobs;
+	pthread_t *threads;
+	long i, j, tmp;
+	int t, n = args.num_threads;
+
+	q->m    = pq_subspaces();
+	q->dsub = args.dim / q->m;
+	q->ksub = vocab_size < PQ_KSUB ? vocab_size : PQ_KSUB;
+
+	/* random sample of rows (partial Fisher-Yates shuffle) */
+	q->n_sample = (long) PQ_SAMPLE * q->ksub;
+	if (q->n_sample > vocab_size)
+		q->n_sample = vocab_size;
+	q->sample    = calloc(vocab_size, sizeof *q->sample);
+	q->centroids = calloc((long) q->m * q->ksub * q->dsub,
+	                      sizeof *q->centroids);
+	q->codes     = calloc(vocab_size * q->m, sizeof *q->codes);
+	jobs         = calloc(n, sizeof *jobs);
+	threads      = calloc(n, sizeof *threads);
+	if (q->sample == NULL || q->centroids == NULL || q->codes == NULL ||
+	    jobs == NULL || threads == NULL)
+	{
+		printf("Cannot allocate memory for product quantization\n");
+		exit(1);
+	}
+
+	for (i = 0; i < vocab_size; ++i)
+		q->sample[i] = i;
+	for (i = 0; i < q->n_sample; ++i)
+	{
+		j = i + next_random(&smp) % (vocab_size - i);
+		tmp          = q->sample[i];
+		q->sample[i] = q->sample[j];
+		q->sample[j] = tmp;
+	}
+
+	for (t = 0; t < n; ++t)
+	{
+		jobs[t].q     = q;
+		jobs[t].first = t;
+		jobs[t].step  = n;
+		jobs[t].seed  = next_random(&smp) | 1;
+		pthread_create(&threads[t], NULL, pq_thread, &jobs[t]);
+	}
+	for (t = 0; t < n; ++t)
+		pthread_join(threads[t], NULL);
+
+	free(threads);
+	free(jobs);
+}
+
+/* quantize: quantize WI in the type of q */
+void quantize(struct quantized *q)
+{
+	long i, j, dim = args.dim;
+	float max;
+
+	if (q->type == VEC_FLOAT16)
+	{
+		if ((q->half = calloc(vocab_size * dim, sizeof *q->half)) == NULL)
+		{
+			printf("Cannot allocate memory to quantize vectors\n");
+			exit(1);
+		}
+		for (i = 0; i < vocab_size; ++i)
+			for (j = 0; j < dim; ++j)
+				q->half[i * dim + j] =
+				    float_to_half(WI[i * row_size + j]);
+	}
+
+	else if (q->type == VEC_INT8)
+	{
+		q->scales = calloc(vocab_size, sizeof *q->scales);
+		q->bytes  = calloc(vocab_size * dim, sizeof *q->bytes);
+		if (q->scales == NULL || q->bytes == NULL)
+		{
+			printf("Cannot allocate memory to quantize vectors\n");
+			exit(1);
+		}
+		for (i = 0; i < vocab_size; ++i)
+		{
+			for (max = 0, j = 0; j < dim; ++j)
+				max = fmaxf(max, fabsf(WI[i * row_size + j]));
+			q->scales[i] = max / 127;
+			for (j = 0; max > 0 && j < dim; ++j)
+				q->bytes[i * dim + j] =
+				    lrintf(WI[i * row_size + j] / q->scales[i]);
+		}
+	}
+
+	else
+		quantize_pq(q);
+}
+
+/* dequantize: write the row i of q in out */
+void dequantize(struct quantized *q, long i, float *out)
+{
+	long j, dim = args.dim;
+	int s;
+
+	if (q->type == VEC_FLOAT16)
+		for (j = 0; j < dim; ++j)
+			out[j] = half_to_float(q->half[i * dim + j]);
+
+	else if (q->type == VEC_INT8)
+		for (j = 0; j < dim; ++j)
+			out[j] = q->scales[i] * q->bytes[i * dim + j];
+
+	else
+		for (s = 0; s < q->m; ++s)
+			memcpy(out + s * q->dsub, q->centroids +
+			       ((long) s * q->ksub + q->codes[i * q->m + s]) *
+			       q->dsub, q->dsub * sizeof *out);
+}
+
+/* write_quantized: write the vectors block of q */
+void write_quantized(FILE *fo, struct quantized *q)
+{
+	uint32_t params[2];
+
+	write_native_header(fo, q->type);
+	if (q->type == VEC_FLOAT16)
+		fwrite(q->half, sizeof *q->half, vocab_size * args.dim, fo);
+
+	else if (q->type == VEC_INT8)
+	{
+		fwrite(q->scales, sizeof *q->scales, vocab_size, fo);
+		fwrite(q->bytes, sizeof *q->bytes, vocab_size * args.dim, fo);
+	}
+
+	else
+	{
+		params[0] = q->m;
+		params[1] = q->ksub;
+		fwrite(params, sizeof *params, 2, fo);
+		fwrite(q->centroids, sizeof *q->centroids,
+		       (long) q->m * q->ksub * q->dsub, fo);
+		fwrite(q->codes, sizeof *q->codes, vocab_size * q->m, fo);
+	}
+}
+
+/* cosine: cosine similarity of a and b */
+static double cosine(const float *a, const float *b)
+{
+	double ab = 0, aa = 0, bb = 0;
+	int j;
+
+	for (j = 0; j < args.dim; ++j)
+	{
+		ab += a[j] * b[j];
+		aa += a[j] * a[j];
+		bb += b[j] * b[j];
+	}
+
+	return (aa > 0 && bb > 0) ? ab / sqrt(aa * bb) : 0;
+}
+
+struct ranked
+{
+	double value;
+	long   index;
+};
+
+int compare_ranked(const void *a, const void *b)
+{
+	double x = ((struct ranked *) a)->value, y = ((struct ranked *) b)->value;
+
+	return (x > y) - (x < y);
+}
+
+/* ranks: replace the values of r by their ranks (ties get their mean rank)
+ * in the original order */
+void ranks(struct ranked *r, long n, double *out)
+{
+	long i, j, k;
+
+	qsort(r, n, sizeof *r, compare_ranked);
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n && r[j].value == r[i].value; ++j)
+			;
+		for (k = i; k < j; ++k)
+			out[r[k].index] = (i + j - 1) / 2.0;
+	}
+}
+
+/* quantization_report: print the reconstruction error of q and how the
+ * cosine similarities of word pairs move */
+void quantization_report(struct quantized *q, char *filename)
+{
+	struct sampler smp = { .rng = 0x2545F4914F6CDD1DULL };
+	struct ranked *r;
+	double num = 0, den = 0, diff, cos_err = 0, cos_max = 0, d2 = 0,
+	       *before, *after, *rank_b, *rank_a;
+	float *x, *y, *wa, *wb;
+	long i, j, n = 0, w;
+	struct pairs *lists[2] = { &strong, &weak };
+	int l;
+
+	x      = calloc(2 * args.dim, sizeof *x);
+	before = calloc(QUANT_PAIRS, sizeof *before);
+	after  = calloc(QUANT_PAIRS, sizeof *after);
+	rank_b = calloc(QUANT_PAIRS, sizeof *rank_b);
+	rank_a = calloc(QUANT_PAIRS, sizeof *rank_a);
+	r      = calloc(QUANT_PAIRS, sizeof *r);
+	if (x == NULL || before == NULL || after == NULL || rank_b == NULL ||
+	    rank_a == NULL || r == NULL)
+	{
+		printf("Cannot allocate memory to evaluate quantization\n");
+		exit(1);
+	}
+	y = x + args.dim;
+
 	for (i = 0; i < vocab_size; ++i)
+	{
+		dequantize(q, i, x);
 		for (j = 0; j < args.dim; ++j)
-			WI[i * args.dim + j] = ( (rand() * r) - 0.5 ) * l;
+		{
+			diff = x[j] - WI[i * row_size + j];
+			num += diff * diff;
+			den += (double) WI[i * row_size + j] *
+			       WI[i * row_size + j];
+		}
+	}
+
+	/* pairs from the pair files, random pairs if there are none */
+	for (l = 0; l < 2; ++l)
+		for (w = 0; w < vocab_size && n < QUANT_PAIRS; ++w)
+			for (j = lists[l]->offsets[w];
+			     j < lists[l]->offsets[w+1] && n < QUANT_PAIRS; ++j)
+			{
+				wa = WI + w * row_size;
+				wb = WI + (long) lists[l]->neighbors[j] * row_size;
+				before[n] = cosine(wa, wb);
+				dequantize(q, w, x);
+				dequantize(q, lists[l]->neighbors[j], y);
+				after[n++] = cosine(x, y);
+			}
+	while (strong.offsets[vocab_size] + weak.offsets[vocab_size] == 0 &&
+	       n < QUANT_PAIRS && vocab_size > 1)
+	{
+		w = next_random(&smp) % vocab_size;
+		j = next_random(&smp) % vocab_size;
+		before[n] = cosine(WI + w * row_size, WI + j * row_size);
+		dequantize(q, w, x);
+		dequantize(q, j, y);
+		after[n++] = cosine(x, y);
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		diff = fabs(after[i] - before[i]);
+		cos_err += diff;
+		cos_max = fmax(cos_max, diff);
+		r[i].value = before[i];
+		r[i].index = i;
+	}
+	ranks(r, n, rank_b);
+	for (i = 0; i < n; ++i)
+	{
+		r[i].value = after[i];
+		r[i].index = i;
+	}
+	ranks(r, n, rank_a);
+	for (i = 0; i < n; ++i)
+		d2 += (rank_a[i] - rank_b[i]) * (rank_a[i] - rank_b[i]);
+
+	printf("Quantized vectors saved in %s\n", filename);
+	printf("  relative reconstruction error: %.3e\n",
+	       den > 0 ? num / den : 0);
+	if (n > 1)
+		printf("  cosine of %ld pairs: mean error %.5f, max error %.5f,"
+		       " Spearman correlation %.5f\n", n, cos_err / n, cos_max,
+		       1 - 6 * d2 / ((double) n * ((double) n * n - 1)));
+
+	free(r);
+	free(rank_a);
+	free(rank_b);
+	free(after);
+	free(before);
+	free(x);
 }
 
-/* destroy_network: free the memory allocated for matrices WI and WO */
-void destroy_network()
+/* save_quantized: quantize WI and save it in filename */
+void save_quantized(char *filename)
 {
-	if (WI != NULL)
-		free(WI);
+	struct quantized q;
+	FILE *fo;
+	long size;
 
-	if (WO != NULL)
-		free(WO);
+	memset(&q, 0, sizeof q);
+	if (!strcmp(args.quantize, "fp16"))
+		q.type = VEC_FLOAT16;
+	else if (!strcmp(args.quantize, "int8"))
+		q.type = VEC_INT8;
+	else
+		q.type = VEC_PQ;
+
+	quantize(&q);
+
+	if ((fo = fopen(filename, "wb")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+	write_quantized(fo, &q);
+	size = ftell(fo);
+	if (fclose(fo) != 0)
+	{
+		printf("ERROR: cannot write vectors in %s\n", filename);
+		exit(1);
+	}
+
+	quantization_report(&q, filename);
+	printf("  size: %.1f MB (float32: %.1f MB)\n", size / 1048576.0,
+	       vocab_size * args.dim * 4.0 / 1048576.0);
+
+	free(q.half);
+	free(q.scales);
+	free(q.bytes);
+	free(q.centroids);
+	free(q.codes);
+	free(q.sample);
+}
+
+/* save the word vectors in output file. If epoch > 0, add the suffix
+ * indicating the epoch */
+void save_vectors(char *output, int epoch)
+{
+	static const char *extensions[] = { ".vec", ".bin", ".d2v" };
+	FILE *fo;
+	char filename[2 * MAXLEN + 32];
+
+	if (epoch > 0)
+		sprintf(filename, "%s-epoch-%d%s", output, epoch,
+		        extensions[args.binary]);
+	else
+		sprintf(filename, "%s%s", output, extensions[args.binary]);
+
+	if ((fo = fopen(filename, "wb")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", filename);
+		exit(1);
+	}
+
+	if (args.binary == 1)
+		write_word2vec(fo);
+	else if (args.binary == 2)
+		write_native(fo);
+	else
+		write_text(fo);
+
+	if (fclose(fo) != 0)
+	{
+		printf("ERROR: cannot write vectors in %s\n", filename);
+		exit(1);
+	}
+
+	/* quantized copy next to the vectors */
+	if (args.quantize[0] != '\0')
+	{
+		if (epoch > 0)
+			sprintf(filename, "%s-epoch-%d-%s.d2v", output, epoch,
+			        args.quantize);
+		else
+			sprintf(filename, "%s-%s.d2v", output, args.quantize);
+		save_quantized(filename);
+	}
 }
 
-void *train_thread(void *id)
+/* init_checkpoint: allocate the copies used by checkpoints */
+void init_checkpoint()
 {
-	FILE *fi;
-	char word[MAXLEN];
-	int w_t, w_c, c, d, target, line_size, pos, line[MAXLINE];
-	int index1, index2, k, half_ws;
-	long word_count_local, negsamp_discarded, negsamp_total;
-	float label, dot_prod, grad, *hidden;
-	double progress, wts, discarded, cps, d_train, lr_coef;
-
-	clock_t now;
-	int rnd = (intptr_t) id;
+	long n = args.num_threads;
 
-	if ((fi = fopen(args.input, "r")) == NULL)
+	ckpt.states = calloc(n, sizeof *ckpt.states);
+	ckpt.pos_sp = calloc(n * (n_paired + 1), sizeof *ckpt.pos_sp);
+	ckpt.pos_wp = calloc(n * (n_paired + 1), sizeof *ckpt.pos_wp);
+	if (ckpt.states == NULL || ckpt.pos_sp == NULL || ckpt.pos_wp == NULL)
 	{
-		printf("ERROR: training data file not found!\n");
+		printf("Cannot allocate memory for checkpoints\n");
 		exit(1);
 	}
 
-	/* init variables */
-	fseek(fi, file_size / args.num_threads * rnd, SEEK_SET);
-	word_count_local = negsamp_discarded = negsamp_total = 0;
-	hidden           = calloc(args.dim, sizeof *hidden);
-	half_ws          = args.window / 2;
-	wts = discarded  = 0.0f;
-	cps              = 1000.0f / CLOCKS_PER_SEC;
-	d_train          = 1.0f / train_words;
-	lr_coef          = args.starting_alpha / ((double) (args.epoch * train_words));
-
-	while (word_count_actual < (train_words * (current_epoch + 1)))
+	/* matrices are only copied to save during an epoch */
+	if (args.checkpoint_every > 0)
 	{
-		/* update learning rate and print progress */
-		if (word_count_local > 20000)
-		{
-			args.alpha -= word_count_local * lr_coef;
-			word_count_actual += word_count_local;
-			word_count_local = 0;
-			now = clock();
-
-			/* "Discarded" is the percentage of discarded negative
-			 * samples because they form either a strong or a weak
-			 * pair with context word */
-			progress = word_count_actual * d_train * 100;
-			progress -= 100 * current_epoch;
-			wts = word_count_actual / ((double)(now - start) * cps);
-			discarded = negsamp_discarded * 100.0 / negsamp_total;
-			printf("%clr: %f  Progress: %.2f%%  Words/thread/sec:"
-			       " %.2fk  Discarded: %.2f%% ",
-			       13, args.alpha, progress, wts, discarded);
-			fflush(stdout);
-		}
-
-		/* read MAXLINE words from input file. Add words in line[] if
-		 * they are in vocabulary and not discarded. So length of line
-		 * might be less than MAXLINE (in practice, length of line is
-		 * 500 +/- 50. */
-		line_size = 0;
-		for (k = MAXLINE; k--;)
+		ckpt.WI = malloc(vocab_size * row_size * sizeof *ckpt.WI);
+		ckpt.WO = malloc(vocab_size * row_size * sizeof *ckpt.WO);
+		if (ckpt.WI == NULL || ckpt.WO == NULL)
 		{
-			/* some words are longer than MAXLEN, need to indicate a
-			 * maximum width to scanf so no buffer overflow. */
-			fscanf(fi, "%100s", word);
-			w_t = vocab_hash[find(word)];
-
-			/* word is not in vocabulary, move to next one */
-			if (w_t == -1)
-				continue;
-
-			/* we processed one more word */
-			++word_count_local;
-
-			/* discard word or add it in the sentence */
-			rnd = rnd * 1103515245 + 12345;
-			if (vocab[w_t].pdiscard < (rnd & 0xFFFF) / 65536.0)
-				continue;
-			else
-				line[line_size++] = w_t;
+			printf("Cannot allocate memory for checkpoints\n");
+			exit(1);
 		}
+	}
+}
 
-		/* for each word of the line */
-		for (pos = half_ws; pos < line_size - half_ws; ++pos)
-		{
-			w_t = line[pos];  /* central word */
+/* destroy_checkpoint: free the copies used by checkpoints */
+void destroy_checkpoint()
+{
+	free(ckpt.states);
+	free(ckpt.pos_sp);
+	free(ckpt.pos_wp);
+	free(ckpt.WI);
+	free(ckpt.WO);
+}
 
-			/* for each word of the context window */
-			for (c = pos - half_ws; c < pos + half_ws +1; ++c)
-			{
-				if (c == pos)
-					continue;
+/* input_kind: return what the training threads read, INPUT_* */
+int input_kind()
+{
+	if (ids.data == NULL)
+		return INPUT_TEXT;
+	return ids.varint ? INPUT_VARINTS : INPUT_IDS;
+}
 
-				w_c = line[c];
-				index1 = w_c * args.dim;
+/* checkpoint_rest: bytes of a checkpoint after the words of the vocabulary
+ * described by header */
+uint64_t checkpoint_rest(const struct checkpoint_header *h)
+{
+	uint64_t n = h->vocab_size, rest;
+
+	rest = 2 * (n + 1) * sizeof *strong.offsets +
+	       (h->n_strong + h->n_weak) * sizeof *strong.neighbors +
+	       2 * n * h->dim * sizeof *WI;
+	if (h->mid_epoch)
+		rest += h->num_threads * sizeof *ckpt.states +
+		        2 * h->num_threads * (h->n_paired + 1) *
+		        sizeof *ckpt.pos_sp + h->n_parts * sizeof(long);
+	return rest;
+}
 
-				/* zero the hidden vector */
-				memset(hidden, 0.0, args.dim * sizeof *hidden);
+/* write_checkpoint: save the training state in filename. If mid_epoch, the
+ * matrices, counters and thread states are the copies made by
+ * copy_checkpoint(), otherwise the current ones. The file is written under
+ * a temporary name then renamed, so a crash never leaves a partial
+ * checkpoint.
+ */
+void write_checkpoint(char *filename, int mid_epoch)
+{
+	struct checkpoint_header header;
+	char tmp[MAXLEN + 8];
+	FILE *fo;
+	long i;
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, "D2VC", 4);
+	header.mid_epoch         = mid_epoch;
+	header.input_size        = file_size;
+	header.vocab_size        = vocab_size;
+	header.dim               = args.dim;
+	header.num_threads       = args.num_threads;
+	header.n_paired          = n_paired;
+	header.train_words       = train_words;
+	header.n_strong          = strong.offsets[vocab_size];
+	header.n_weak            = weak.offsets[vocab_size];
+	header.input_kind        = input_kind();
+	header.input_bytes       = (ids.data != NULL) ? ids.end - ids.data :
+	                           file_size;
+	if (mid_epoch)
+	{
+		header.epoch             = current_epoch;
+		header.n_parts           = sched.n_parts;
+		header.word_count_actual = ckpt.word_count_actual;
+		header.negsamp_rejected  = ckpt.negsamp_rejected;
+		header.alpha             = ckpt.alpha;
+	}
+	else
+	{
+		header.epoch             = current_epoch + 1;
+		header.word_count_actual = word_count_actual;
+		header.negsamp_rejected  = negsamp_rejected;
+		header.alpha             = args.alpha;
+	}
 
-				/* STANDARD AND NEGATIVE SAMPLING UPDATE */
-				for (d = args.negative+1; d--;)
-				{
-					/* target is central word */
-					if (d == 0)
-					{
-						target = w_t;
-						label = 1.0;
-					}
+	sprintf(tmp, "%s.tmp", filename);
+	if ((fo = fopen(tmp, "wb")) == NULL)
+	{
+		printf("Cannot open %s: permission denied\n", tmp);
+		exit(1);
+	}
 
-					/* target is random word */
-					else
-					{
-						do
-						{
-							target = table[neg_pos++];
-							if (neg_pos > table_size-1)
-								neg_pos = 0;
-						} while (target == w_t);
+	/* header, counts of words, then the words ended by '\0' */
+	fwrite(&header, sizeof header, 1, fo);
+	for (i = 0; i < vocab_size; ++i)
+		fwrite(&vocab[i].count, sizeof vocab[i].count, 1, fo);
+	for (i = 0; i < vocab_size; ++i)
+		fwrite(vocab_word(i), 1, strlen(vocab_word(i)) + 1, fo);
 
-						/* if random word form a strong a weak pair
-						 with w_c, move to next one */
-						if (contains(vocab[w_c].sp, target,
-						             vocab[w_c].n_sp) ||
-						    contains(vocab[w_c].wp, target,
-						             vocab[w_c].n_wp))
-						{
-							++negsamp_discarded;
-							continue;
-						}
+	/* neighbor lists, hash sets are rebuilt when loading */
+	fwrite(strong.offsets, sizeof *strong.offsets, vocab_size + 1, fo);
+	fwrite(strong.neighbors, sizeof *strong.neighbors, header.n_strong, fo);
+	fwrite(weak.offsets, sizeof *weak.offsets, vocab_size + 1, fo);
+	fwrite(weak.neighbors, sizeof *weak.neighbors, header.n_weak, fo);
 
-						++negsamp_total;
-						label = 0.0;
-					}
+	write_rows(fo, mid_epoch ? ckpt.WI : WI);
+	write_rows(fo, mid_epoch ? ckpt.WO : WO);
 
+	if (mid_epoch)
+	{
+		fwrite(ckpt.states, sizeof *ckpt.states, args.num_threads, fo);
+		fwrite(ckpt.pos_sp, sizeof *ckpt.pos_sp,
+		       args.num_threads * (n_paired + 1), fo);
+		fwrite(ckpt.pos_wp, sizeof *ckpt.pos_wp,
+		       args.num_threads * (n_paired + 1), fo);
+		fwrite(ckpt.next_chunk, sizeof *ckpt.next_chunk,
+		       sched.n_parts, fo);
+	}
 
-					/* forward propagation */
-					index2 = target * args.dim;
-					dot_prod = 0.0;
-					for (k = 0; k < args.dim; ++k)
-						dot_prod += WI[index1 + k] * WO[index2 + k];
-
-					if (dot_prod > MAX_SIGMOID)
-						grad = args.alpha * (label - 1.0);
-					else if (dot_prod < -MAX_SIGMOID)
-						grad = args.alpha * label;
-					else
-						grad = args.alpha * (label - sigmoid(dot_prod));
-
-					/* back-propagation. 2 for loops is more
-					 cache friendly because processor
-					 can load the entire hidden array in
-					 cache. Using a unique for loop to do
-					 the 2 operations is slower. */
-					for (k = 0; k < args.dim; ++k)
-						hidden[k] += grad * WO[index2 + k];
-					for (k = 0; k < args.dim; ++k)
-						WO[index2 + k] += grad * WI[index1 + k];
-				}
+	if (fclose(fo) != 0 || rename(tmp, filename) != 0)
+	{
+		printf("ERROR: cannot write checkpoint %s\n", filename);
+		exit(1);
+	}
+}
 
-				/* POSITIVE SAMPLING UPDATE (strong pairs) */
-				for (d = args.strong_draws; d--;)
-				{
-					/* can't do anything if no strong pairs
-					 */
-					if (vocab[w_c].n_sp == 0)
-						break;
+/* copy_checkpoint: stop the training threads, copy the matrices and the
+ * counters, then release them. Called by the main thread during an epoch.
+ */
+void copy_checkpoint()
+{
+	int i;
 
-					if (vocab[w_c].pos_sp > vocab[w_c].n_sp - 1)
-						vocab[w_c].pos_sp = 0;
-					target = vocab[w_c].sp[vocab[w_c].pos_sp++];
+	pthread_mutex_lock(&ckpt.lock);
+	ckpt.stopped = 0;
+	__atomic_store_n(&ckpt.request, 1, __ATOMIC_RELEASE);
+	while (ckpt.stopped < ckpt.running)
+		pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+
+	memcpy(ckpt.WI, WI, vocab_size * row_size * sizeof *WI);
+	memcpy(ckpt.WO, WO, vocab_size * row_size * sizeof *WO);
+	ckpt.word_count_actual = word_count_actual;
+	ckpt.negsamp_rejected  = negsamp_rejected;
+	ckpt.alpha             = args.alpha;
+	for (i = 0; i < sched.n_parts; ++i)
+		ckpt.next_chunk[i] = sched.parts[i].next;
+
+	__atomic_store_n(&ckpt.request, 0, __ATOMIC_RELEASE);
+	++ckpt.generation;
+	pthread_cond_broadcast(&ckpt.cond);
+	pthread_mutex_unlock(&ckpt.lock);
+}
 
-					index2 = target * args.dim;
-					dot_prod = 0;
-					for (k = 0; k < args.dim; ++k)
-						dot_prod += WI[index1 + k] * WO[index2 + k];
+/* wait_epoch: wait for the training threads of the epoch to finish, saving
+ * a checkpoint every -checkpoint-every seconds and writing the progress
+ * metrics every -metrics-every seconds */
+void wait_epoch()
+{
+	struct timespec deadline;
+	double now, next, next_ckpt, next_metrics;
+	int done, saving;
+
+	saving = args.checkpoint[0] != '\0' && args.checkpoint_every > 0;
+	if (!saving && (metrics.out == NULL || args.metrics_every <= 0))
+		return;
+
+	now          = wall_time();
+	next_ckpt    = saving ? now + args.checkpoint_every : 1e300;
+	next_metrics = (metrics.out != NULL && args.metrics_every > 0) ?
+	               now + args.metrics_every : 1e300;
+	for (;;)
+	{
+		/* timed waits use the realtime clock */
+		next = (next_ckpt < next_metrics) ? next_ckpt : next_metrics;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		next = deadline.tv_sec + deadline.tv_nsec * 1e-9 +
+		       (next - wall_time());
+		deadline.tv_sec  = next;
+		deadline.tv_nsec = (next - deadline.tv_sec) * 1e9;
+
+		pthread_mutex_lock(&ckpt.lock);
+		while (ckpt.running > 0 &&
+		       pthread_cond_timedwait(&ckpt.cond, &ckpt.lock,
+		                              &deadline) == 0)
+			continue;
+		done = (ckpt.running == 0);
+		pthread_mutex_unlock(&ckpt.lock);
 
-					/* dot product is already high, nothing to do */
-					if (dot_prod > MAX_SIGMOID)
-						continue;
-					else if (dot_prod < -MAX_SIGMOID)
-						grad = args.alpha * args.beta_strong;
-					else
-						grad = args.alpha * args.beta_strong *
-						    (1 - sigmoid(dot_prod));
+		if (done)
+			return;
 
+		now = wall_time();
+		if (now >= next_metrics)
+		{
+			write_progress();
+			next_metrics += args.metrics_every;
+			if (next_metrics < now)
+				next_metrics = now + args.metrics_every;
+		}
+		if (now >= next_ckpt)
+		{
+			copy_checkpoint();
+			write_checkpoint(args.checkpoint, 1);
+			next_ckpt = wall_time() + args.checkpoint_every;
+		}
+	}
+}
 
-					for (k = 0; k < args.dim; ++k)
-						hidden[k] += grad * WO[index2 + k];
-					for (k = 0; k < args.dim; ++k)
-						WO[index2 + k] += grad * WI[index1 + k];
-				}
+/* read_checkpoint: restore the state saved in filename instead of reading
+ * the vocabulary from the input file. The input file must be the same.
+ */
+void read_checkpoint(char *filename)
+{
+	struct checkpoint_header header;
+	char *map, *p, *words_end;
+	long i, size, n, len;
 
-				/* POSITIVE SAMPLING UPDATE (weak pairs) */
-				for (d = args.weak_draws; d--;)
-				{
-					/* can't do anything if no weak pairs */
-					if (vocab[w_c].n_wp == 0)
-						break;
+	if ((map = map_file(filename, &size)) == NULL ||
+	    size < (long) sizeof header)
+	{
+		printf("ERROR: cannot read checkpoint %s\n", filename);
+		exit(1);
+	}
+	memcpy(&header, map, sizeof header);
+	p = map + sizeof header;
 
-					if (vocab[w_c].pos_wp > vocab[w_c].n_wp - 1)
-						vocab[w_c].pos_wp = 0;
-					target = vocab[w_c].wp[vocab[w_c].pos_wp++];
+	if (memcmp(header.magic, "D2VC", 4) != 0)
+	{
+		printf("ERROR: %s is not a checkpoint\n", filename);
+		exit(1);
+	}
 
-					index2 = target * args.dim;
-					dot_prod = 0;
-					for (k = 0; k < args.dim; ++k)
-						dot_prod += WI[index1 + k] * WO[index2 + k];
+	/* the file must hold everything the header describes (at least one
+	 * byte per word) before anything is read after the header */
+	if (header.vocab_size > (uint64_t) size ||
+	    header.n_strong > (uint64_t) size ||
+	    header.n_weak > (uint64_t) size ||
+	    header.n_paired > header.vocab_size ||
+	    header.num_threads > (uint64_t) size ||
+	    header.dim > (uint64_t) size || header.n_parts > MAX_NODES ||
+	    header.input_kind > INPUT_VARINTS ||
+	    (uint64_t) size < sizeof header + header.vocab_size *
+	                      (sizeof(long) + 1) + checkpoint_rest(&header))
+	{
+		printf("ERROR: checkpoint %s is truncated or corrupted\n",
+		       filename);
+		exit(1);
+	}
+	if ((int) header.dim != args.dim)
+	{
+		printf("ERROR: checkpoint has -size %ld\n", (long) header.dim);
+		exit(1);
+	}
+	if (header.mid_epoch && (int) header.num_threads != args.num_threads)
+	{
+		printf("ERROR: checkpoint saved during an epoch with -threads "
+		       "%ld\n", (long) header.num_threads);
+		exit(1);
+	}
 
-					if (dot_prod > MAX_SIGMOID)
-						continue;
-					else if (dot_prod < -MAX_SIGMOID)
-						grad = args.alpha * args.beta_weak;
-					else
-						grad = args.alpha * args.beta_weak *
-						    (1 - sigmoid(dot_prod));
+	open_corpus(args.input);
+	if ((long) header.input_size != file_size)
+	{
+		printf("ERROR: -input is not the file of the checkpoint\n");
+		exit(1);
+	}
 
-					for (k = 0; k < args.dim; ++k)
-						hidden[k] += grad * WO[index2 + k];
-					for (k = 0; k < args.dim; ++k)
-						WO[index2 + k] += grad * WI[index1 + k];
-				}
+	/* vocabulary, in the same order. Each word must end before the
+	 * rest of the checkpoint */
+	resize_vocab_hash(header.vocab_size);
+	n = header.vocab_size;
+	words_end = map + size - checkpoint_rest(&header);
+	for (i = 0, len = 0; i < n; ++i)
+	{
+		if (memchr(p + n * sizeof(long) + len, '\0',
+		           words_end - (p + n * sizeof(long) + len)) == NULL)
+		{
+			printf("ERROR: checkpoint %s is truncated or corrupted\n",
+			       filename);
+			exit(1);
+		}
+		add_word(p + n * sizeof(long) + len,
+		         strlen(p + n * sizeof(long) + len),
+		         ((long *) p)[i]);
+		len += strlen(vocab_word(i)) + 1;
+	}
+	p += n * sizeof(long) + len;
+	train_words = header.train_words;
+
+	/* pairs */
+	strong.offsets   = malloc((n + 1) * sizeof *strong.offsets);
+	strong.neighbors = malloc((header.n_strong + 1) *
+	                          sizeof *strong.neighbors);
+	weak.offsets     = malloc((n + 1) * sizeof *weak.offsets);
+	weak.neighbors   = malloc((header.n_weak + 1) * sizeof *weak.neighbors);
+	if (strong.offsets == NULL || strong.neighbors == NULL ||
+	    weak.offsets == NULL || weak.neighbors == NULL)
+	{
+		printf("Cannot allocate memory for pairs\n");
+		exit(1);
+	}
+	memcpy(strong.offsets, p, (n + 1) * sizeof *strong.offsets);
+	p += (n + 1) * sizeof *strong.offsets;
+	memcpy(strong.neighbors, p, header.n_strong * sizeof *strong.neighbors);
+	p += header.n_strong * sizeof *strong.neighbors;
+	memcpy(weak.offsets, p, (n + 1) * sizeof *weak.offsets);
+	p += (n + 1) * sizeof *weak.offsets;
+	memcpy(weak.neighbors, p, header.n_weak * sizeof *weak.neighbors);
+	p += header.n_weak * sizeof *weak.neighbors;
+	build_pair_sets(&strong);
+	build_pair_sets(&weak);
+	index_paired_words();
+	if (n_paired != (long) header.n_paired ||
+	    size < p - map + 2 * n * args.dim * (long) sizeof *WI)
+	{
+		printf("ERROR: checkpoint %s is corrupted\n", filename);
+		exit(1);
+	}
 
-				/* Back-propagate hidden -> input */
-				for (k = 0; k < args.dim; ++k)
-					WI[index1 + k] += hidden[k];
+	compute_discard_prob();
+	madvise(corpus.data, file_size, MADV_RANDOM);
 
-			} /* end for each word in the context window */
+	init_network();
+	for (i = 0; i < n; ++i, p += args.dim * sizeof *WI)
+		memcpy(WI + i * row_size, p, args.dim * sizeof *WI);
+	for (i = 0; i < n; ++i, p += args.dim * sizeof *WO)
+		memcpy(WO + i * row_size, p, args.dim * sizeof *WO);
 
-		}     /* end for each word in line */
-	}         /* end while() loop for reading file */
+	init_checkpoint();
+	if (header.mid_epoch)
+	{
+		memcpy(ckpt.states, p, args.num_threads * sizeof *ckpt.states);
+		p += args.num_threads * sizeof *ckpt.states;
+		memcpy(ckpt.pos_sp, p, args.num_threads * (n_paired + 1) *
+		       sizeof *ckpt.pos_sp);
+		p += args.num_threads * (n_paired + 1) * sizeof *ckpt.pos_sp;
+		memcpy(ckpt.pos_wp, p, args.num_threads * (n_paired + 1) *
+		       sizeof *ckpt.pos_wp);
+		p += args.num_threads * (n_paired + 1) * sizeof *ckpt.pos_wp;
+		if (header.n_parts != (uint64_t) ((args.numa == 2) ? numa.n_nodes : 1)
+		    || header.n_parts > MAX_NODES)
+		{
+			printf("ERROR: checkpoint saved during an epoch with other "
+			       "-numa partitions\n");
+			exit(1);
+		}
+		memcpy(ckpt.next_chunk, p, header.n_parts * sizeof(long));
+		ckpt.resume      = 1;
+		ckpt.input_kind  = header.input_kind;
+		ckpt.input_bytes = header.input_bytes;
+	}
 
-	/* sometimes, progress go over 100% because of rounding float error.
-	print a proper 100% progress */
-	if (args.alpha < 0) args.alpha = 0;
-	printf("%clr: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  Discarded:"
-	       " %.2f%% ", 13, args.alpha, 100.0, wts, discarded);
-	fflush(stdout);
+	current_epoch     = header.epoch;
+	word_count_actual = header.word_count_actual;
+	negsamp_rejected  = header.negsamp_rejected;
+	args.alpha        = header.alpha;
 
-	fclose(fi);
-	free(hidden);
-	pthread_exit(NULL);
+	munmap(map, size);
+	printf("Resuming epoch %d from %s\n", current_epoch + 1, filename);
+	printf("Vocab size: %ld\n", vocab_size);
+	printf("Words in train file: %ld\n", train_words);
 }
 
-/* save the word vectors in output file. If epoch > 0, add the suffix
- * indicating the epoch */
-void save_vectors(char *output, int epoch)
+/* check_resume_input: the threads of a checkpoint saved during an epoch
+ * restart at offsets in what they read, which must not have changed. Called
+ * once the id cache is loaded. */
+void check_resume_input()
 {
-	FILE *fo;
-	char suffix[15], copy[MAXLEN];
-	int i, j;
+	static const char *kinds[] = { "the text", "an id cache",
+	                               "a varint id cache" };
+	long bytes = (ids.data != NULL) ? ids.end - ids.data : file_size;
 
-	if (epoch > 0)
+	if (!ckpt.resume)
+		return;
+	if (ckpt.input_kind != input_kind() || ckpt.input_bytes != bytes)
 	{
-		sprintf(suffix, "-epoch-%d.vec", epoch);
-		strcpy(copy, output);
-		fo = fopen(strcat(copy, suffix), "w");
+		printf("ERROR: checkpoint saved during an epoch reading %s of "
+		       "%ld bytes, not %s of %ld bytes\n",
+		       kinds[ckpt.input_kind], ckpt.input_bytes,
+		       kinds[input_kind()], bytes);
+		exit(1);
 	}
+}
 
-	else
-		fo = fopen(strcat(output, ".vec"), "w");
+/* start_pool: create the training threads, waiting for the first epoch */
+void start_pool()
+{
+	int i;
 
-	if (fo == NULL)
+	pool.threads = calloc(args.num_threads, sizeof *pool.threads);
+	pool.words   = calloc(args.num_threads, sizeof *pool.words);
+	pool.updates = calloc(args.num_threads, sizeof *pool.updates);
+	if (pool.threads == NULL || pool.words == NULL || pool.updates == NULL)
 	{
-		printf("Cannot open %s: permission denied\n", output);
+		printf("Cannot allocate memory for threads\n");
 		exit(1);
 	}
 
-	/* first line is number of vectors + dimension */
-	fprintf(fo, "%ld %d\n", vocab_size, args.dim);
+	pthread_barrier_init(&pool.start, NULL, args.num_threads + 1);
+	pthread_barrier_init(&pool.end, NULL, args.num_threads + 1);
+	for (i = 0; i < args.num_threads; i++)
+		pthread_create(&pool.threads[i], NULL, worker_thread,
+		               (void *) (intptr_t) i);
+}
 
-	for (i = 0; i < vocab_size; i++)
+/* numa_report: print the words/sec of the threads of each node during the
+ * last epoch, which lasted seconds. The memory traffic is estimated from the
+ * number of dot products, each one reading a row of WI and reading and
+ * writing a row of WO. */
+void numa_report(double seconds)
+{
+	long words, updates;
+	int node, i, n;
+
+	printf("\n");
+	for (node = 0; node < numa.n_nodes; ++node)
 	{
-		fprintf(fo, "%s ", vocab[i].word);
+		words = updates = 0;
+		for (i = 0, n = 0; i < args.num_threads; ++i)
+			if (node_of_thread(i) == node)
+			{
+				words   += pool.words[i];
+				updates += pool.updates[i];
+				++n;
+			}
+
+		printf("Node %d: %d threads, %.2fk words/sec, ~%.2f GB/s of "
+		       "weights\n", numa.ids[node], n, words / seconds / 1000,
+		       updates * 3.0 * args.dim * sizeof(float) / seconds / 1e9);
+	}
+}
 
-		for (j = 0; j < args.dim; j++)
-			fprintf(fo, "%.3f ", WI[i * args.dim + j]);
+/* run_epoch: train current_epoch with the pool, return when it is done */
+void run_epoch()
+{
+	double begin;
+	int p;
+
+	for (p = 0; p < sched.n_parts; ++p)
+		sched.parts[p].next = ckpt.resume ? ckpt.next_chunk[p] :
+		                      sched.parts[p].first;
+	ckpt.running = args.num_threads;
+	begin = wall_time();
+	if (stream.on)
+		start_stream();
+	if (args.readers)
+		start_readers();
+	pthread_barrier_wait(&pool.start);
+
+	/* save checkpoints and metrics while the threads train */
+	wait_epoch();
+
+	pthread_barrier_wait(&pool.end);
+	if (args.readers)
+		stop_readers();
+	if (stream.on)
+		stop_stream();
+	write_progress();
+
+	if (args.numa)
+		numa_report(wall_time() - begin);
+}
 
-		fprintf(fo, "\n");
-	}
+/* stop_pool: end the training threads */
+void stop_pool()
+{
+	int i;
 
-	fclose(fo);
+	pool.quit = 1;
+	pthread_barrier_wait(&pool.start);
+	for (i = 0; i < args.num_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	pthread_barrier_destroy(&pool.start);
+	pthread_barrier_destroy(&pool.end);
+	free(pool.threads);
+	free(pool.words);
+	free(pool.updates);
 }
 
 int arg_pos(char *str, int argc, char **argv)
@@ -926,13 +5553,29 @@ void print_help()
 	printf(
 	"Options:\n"
 	"  -input <file>\n"
-	"    Train the model with text data from <file>\n\n"
+	"    Train the model with text data from <file>. If <file> is - or a\n"
+	"    named pipe, it is streamed instead of mapped in memory, and can\n"
+	"    only be read once (-read-vocab and -epoch 1 are needed)\n\n"
+	"  -input-cmd <command>\n"
+	"    Stream the text data written by <command> instead of -input. The\n"
+	"    command is run once to count the vocabulary, then once per epoch\n\n"
+	"  -read-vocab <file>\n"
+	"    Read the vocabulary (one word and its count per line) from <file>\n"
+	"    instead of counting it from the input. A file saved by -save-vocab\n"
+	"    is rejected if the input has changed since\n\n"
+	"  -save-vocab <file>\n"
+	"    Save the counts of all words of the input in <file>, to skip\n"
+	"    counting them in the next runs with -read-vocab\n\n"
 	"  -strong-file <file>\n"
 	"    Add strong pairs data from <file> to improve the model\n\n"
 	"  -weak-file <file>\n"
 	"    Add weak pairs data from <file> to improve the model\n\n"
 	"  -output <file>\n"
 	"    Save word embeddings in <file>\n\n"
+	"  -cache <file>\n"
+	"    Train from the vocabulary indexes of words stored in <file>. The\n"
+	"    file is created from -input if it does not exist or if it was\n"
+	"    built with another vocabulary\n\n"
 	);
 
 	printf(
@@ -947,6 +5590,9 @@ void print_help()
 	"    Do not train words with less than <int> occurrences; default 5\n\n"
 	"  -negative <int>\n"
 	"    Number of random words used for negative sampling; default 5\n\n"
+	"  -neg-power <float>\n"
+	"    Negative samples are drawn with probability count^<float>;\n"
+	"    default 0.75\n\n"
 	"  -alpha <float>\n"
 	"    Starting learning rate; default 0.025\n\n"
 	);
@@ -965,7 +5611,65 @@ void print_help()
 	"  -epoch <int>\n"
 	"    Number of epoch; default 1\n\n"
 	"  -save-each-epoch <int>\n"
-	"    Save the embeddings after each epoch; 0 (off, default), 1 (on)"
+	"    Save the embeddings after each epoch; 0 (off, default), 1 (on)\n\n"
+	"  -cache-varint <int>\n"
+	"    Store indexes of -cache as varints; 0 (off, default), 1 (on)\n\n"
+	"  -simd <name>\n"
+	"    Instructions used by the training kernels: auto (default), avx512,\n"
+	"    avx2, sse2 or scalar\n\n"
+	"  -shared-negatives <int>\n"
+	"    Train all context words of a window against the same negative\n"
+	"    samples with matrix products; 0 (off, default), 1 (on)\n\n"
+	"  -sigmoid <name>\n"
+	"    Evaluation of the sigmoid: table (default, 512 values on [-4, 4]),\n"
+	"    fine (8192 values on [-8, 8]) or rational (approximation on\n"
+	"    [-9.94, 9.94]). It is exactly 0 or 1 outside the range, so fine\n"
+	"    and rational skip fewer pair updates with a zero gradient\n\n"
+	"  -binary <int>\n"
+	"    Format of the embeddings: 0 text .vec (default), 1 word2vec binary\n"
+	"    .bin, 2 native .d2v to map in memory (see README)\n\n"
+	"  -quantize <name>\n"
+	"    Also save the embeddings in <output>-<name>.d2v quantized as fp16,\n"
+	"    int8 (scaled per word) or pq (product quantization), and print the\n"
+	"    error it causes; default none\n\n"
+	"  -pq-m <int>\n"
+	"    Number of subspaces (1 byte each) of -quantize pq; must divide\n"
+	"    -size. The default is the divisor of -size nearest to -size / 4;\n"
+	"    it is required when that gives subspaces of less than 2 or more\n"
+	"    than 8 values (a prime -size, for instance)\n\n"
+	"  -checkpoint <file>\n"
+	"    Save the whole training state in <file> after each epoch\n\n"
+	"  -checkpoint-every <int>\n"
+	"    Also save it every <int> seconds during an epoch; default 0\n\n"
+	"  -resume <file>\n"
+	"    Continue the training saved in the checkpoint <file>. -input and\n"
+	"    -size must not change, nor -threads if it was saved during an epoch\n\n"
+	"  -pin <int>\n"
+	"    Pin each thread to its own CPU; 0 (off, default), 1 (on)\n\n"
+	"  -numa <int>\n"
+	"    0 (off, default), 1 interleave the matrices over the NUMA nodes and\n"
+	"    spread threads over the nodes, 2 also give each node its own part\n"
+	"    of the input. Words/sec of each node are printed after each epoch\n\n"
+	"  -huge-pages <int>\n"
+	"    Back WI and WO with huge pages; 0 (off, default), 1 transparent\n"
+	"    huge pages, 2 reserved huge pages (falls back to 1 if none are free)\n\n"
+	"  -hot-rows <int>\n"
+	"    Give each thread its own copy of the output vectors of the <int>\n"
+	"    most frequent words, merged in the shared ones; default 0 (off)\n\n"
+	"  -hot-sync <int>\n"
+	"    Words trained by a thread between two merges of its copy; default\n"
+	"    10000\n\n"
+	"  -metrics <file>\n"
+	"    Append training metrics to <file> as JSON lines, or send them to\n"
+	"    it if it is a Unix socket\n\n"
+	"  -metrics-every <int>\n"
+	"    Seconds between two progress lines of -metrics; default 10\n\n"
+	"  -readers <int>\n"
+	"    Number of threads parsing and subsampling the input for the\n"
+	"    -threads training threads; default 0 (each thread parses its own)\n\n"
+	"  -queue-depth <int>\n"
+	"    Blocks of sentences queued per training thread with -readers;\n"
+	"    default 4"
 	);
 
 	printf(
@@ -992,6 +5696,26 @@ void parse_args(int argc, char **argv, struct parameters *args,
 			strcpy(args->input, *++argv);
 		if (strcmp(*argv, "-output") == 0)
 			strcpy(args->output, *++argv);
+		if (strcmp(*argv, "-cache") == 0)
+			strcpy(args->cache, *++argv);
+		if (strcmp(*argv, "-simd") == 0)
+			strcpy(args->simd, *++argv);
+		if (strcmp(*argv, "-sigmoid") == 0)
+			strcpy(args->sigmoid, *++argv);
+		if (strcmp(*argv, "-quantize") == 0)
+			strcpy(args->quantize, *++argv);
+		if (strcmp(*argv, "-checkpoint") == 0)
+			strcpy(args->checkpoint, *++argv);
+		if (strcmp(*argv, "-resume") == 0)
+			strcpy(args->resume, *++argv);
+		if (strcmp(*argv, "-metrics") == 0)
+			strcpy(args->metrics, *++argv);
+		if (strcmp(*argv, "-read-vocab") == 0)
+			strcpy(args->read_vocab, *++argv);
+		if (strcmp(*argv, "-save-vocab") == 0)
+			strcpy(args->save_vocab, *++argv);
+		if (strcmp(*argv, "-input-cmd") == 0)
+			strcpy(args->input_cmd, *++argv);
 
 		/* integer arguments */
 		if (strcmp(*argv, "-size") == 0)
@@ -1012,6 +5736,32 @@ void parse_args(int argc, char **argv, struct parameters *args,
 			args->epoch = atoi(*++argv);
 		if (strcmp(*argv, "-save-each-epoch") == 0)
 			args->save_each_epoch = atoi(*++argv);
+		if (strcmp(*argv, "-cache-varint") == 0)
+			args->cache_varint = atoi(*++argv);
+		if (strcmp(*argv, "-shared-negatives") == 0)
+			args->shared_negatives = atoi(*++argv);
+		if (strcmp(*argv, "-binary") == 0)
+			args->binary = atoi(*++argv);
+		if (strcmp(*argv, "-pq-m") == 0)
+			args->pq_m = atoi(*++argv);
+		if (strcmp(*argv, "-checkpoint-every") == 0)
+			args->checkpoint_every = atoi(*++argv);
+		if (strcmp(*argv, "-pin") == 0)
+			args->pin = atoi(*++argv);
+		if (strcmp(*argv, "-numa") == 0)
+			args->numa = atoi(*++argv);
+		if (strcmp(*argv, "-huge-pages") == 0)
+			args->huge_pages = atoi(*++argv);
+		if (strcmp(*argv, "-hot-rows") == 0)
+			args->hot_rows = atoi(*++argv);
+		if (strcmp(*argv, "-hot-sync") == 0)
+			args->hot_sync = atoi(*++argv);
+		if (strcmp(*argv, "-metrics-every") == 0)
+			args->metrics_every = atoi(*++argv);
+		if (strcmp(*argv, "-readers") == 0)
+			args->readers = atoi(*++argv);
+		if (strcmp(*argv, "-queue-depth") == 0)
+			args->queue_depth = atoi(*++argv);
 
 		/* float arguments */
 		if (strcmp(*argv, "-alpha") == 0)
@@ -1022,14 +5772,17 @@ void parse_args(int argc, char **argv, struct parameters *args,
 			args->beta_strong = atof(*++argv);
 		if (strcmp(*argv, "-beta-weak") == 0)
 			args->beta_weak = atof(*++argv);
+		if (strcmp(*argv, "-neg-power") == 0)
+			args->neg_power = atof(*++argv);
 	}
 }
 
+/* dict2vec-bench.c includes this file without main() to time its functions */
+#ifndef DICT2VEC_NO_MAIN
 int main(int argc, char **argv)
 {
-	char spairs_file[MAXLEN], wpairs_file[MAXLEN];
-	int i;
-	pthread_t *threads;
+	char spairs_file[MAXLEN] = "", wpairs_file[MAXLEN] = "";
+	double t;
 
 	/* no arguments given. Print help and exit */
 	if (argc == 1)
@@ -1040,53 +5793,138 @@ int main(int argc, char **argv)
 
 	parse_args(argc, argv, &args, spairs_file, wpairs_file);
 
-	if (strlen(args.input) == 0)
+	if (strlen(args.input) == 0 && strlen(args.input_cmd) == 0)
 	{
 		printf("Cannot train the model without: -input <file>\n");
 		exit(1);
 	}
 
-	/* initialise vocabulary table */
-	vocab = (struct entry *)calloc(vocab_max_size, sizeof(struct entry));
-	vocab_hash = (int *)calloc(HASHSIZE, sizeof(int));
+	if (args.readers < 0 || args.queue_depth < 1)
+	{
+		printf("ERROR: -readers must be >= 0 and -queue-depth >= 1\n");
+		exit(1);
+	}
 
+	/* the reader threads do not save their position in a checkpoint */
+	if (args.readers > 0 && args.checkpoint_every > 0)
+	{
+		printf("ERROR: -checkpoint-every can not be used with "
+		       "-readers\n");
+		exit(1);
+	}
 
+	/* a stream can only be read from the start, once per pass */
+	if ((stream.on = is_stream()))
+	{
+		if (args.checkpoint[0] != '\0' || args.resume[0] != '\0' ||
+		    args.cache[0] != '\0')
+		{
+			printf("ERROR: -checkpoint, -resume and -cache need an "
+			       "input file, not a stream\n");
+			exit(1);
+		}
+		if (args.input_cmd[0] == '\0' &&
+		    (args.read_vocab[0] == '\0' || args.epoch > 1))
+		{
+			printf("ERROR: a pipe can only be read once: use "
+			       "-read-vocab and -epoch 1, or -input-cmd\n");
+			exit(1);
+		}
+		init_stream();
+	}
 
-	/*********** train ***/
-	/* variable for future use */
+	if (args.binary < 0 || args.binary > 2)
+	{
+		printf("ERROR: -binary must be 0, 1 or 2\n");
+		exit(1);
+	}
 
-	if ((threads = calloc(args.num_threads, sizeof *threads)) == NULL)
+	if (args.quantize[0] != '\0' && strcmp(args.quantize, "fp16") &&
+	    strcmp(args.quantize, "int8") && strcmp(args.quantize, "pq"))
 	{
-		printf("Cannot allocate memory for threads\n");
+		printf("ERROR: unknown -quantize value %s\n", args.quantize);
 		exit(1);
 	}
 
+	/* check the subspaces now rather than after the training */
+	if (!strcmp(args.quantize, "pq"))
+		pq_subspaces();
+
+	init_metrics();
+
+	/* initialise vocabulary table */
+	vocab = (struct entry *)calloc(vocab_max_size, sizeof(struct entry));
+
+
+
+	/*********** train ***/
+
+	/* choose the training kernels and find the NUMA nodes */
+	init_kernels(args.simd);
+	init_numa();
+	init_sigmoid(args.sigmoid);
+
 	/* get words from input file */
-	printf("Starting training using file %s\n", args.input);
-	read_vocab(args.input, spairs_file, wpairs_file);
+	printf("Starting training using %s %s\n", args.input_cmd[0] ?
+	       "command" : "file", args.input_cmd[0] ? args.input_cmd :
+	       args.input);
+	printf("Using %s kernels\n", kern.name);
 
-	/* instantiate the network */
-	init_network();
+	/* a checkpoint holds the vocabulary, the pairs and the network */
+	if (strlen(args.resume) > 0)
+	{
+		t = wall_time();
+		read_checkpoint(args.resume);
+		if (ckpt.resume && args.readers > 0)
+		{
+			printf("ERROR: a checkpoint saved during an epoch can "
+			       "not be resumed with -readers\n");
+			exit(1);
+		}
+	}
+	else
+	{
+		read_vocab(args.input, spairs_file, wpairs_file);
+		t = wall_time();
+		init_network();
+		if (strlen(args.checkpoint) > 0)
+			init_checkpoint();
+	}
+
+	/* encode the input file into indexes of words (or reuse them) */
+	if (strlen(args.cache) > 0)
+		load_id_cache(args.cache);
+	check_resume_input();
 
 	/* instantiate negative table (for negative sampling) */
 	if (args.negative > 0)
 		init_negative_table();
 
+	/* hot rows can not be more than the words */
+	if (args.hot_rows < 0 || args.hot_rows > vocab_size)
+		args.hot_rows = (args.hot_rows < 0) ? 0 : vocab_size;
+	if (args.hot_sync < 1)
+		args.hot_sync = 1;
+	end_phase(PHASE_INIT, t);
+
 	/* train the model for multiple epoch */
-	start = clock();
-	for (current_epoch = 0; current_epoch < args.epoch; current_epoch++)
+	metrics.last = start = wall_time();
+	start_words  = word_count_actual;
+	if (!stream.on)
+		init_scheduler();
+	if (args.readers)
+		init_pipeline();
+	start_pool();
+	for (; current_epoch < args.epoch; current_epoch++)
 	{
 		printf("\n-- Epoch %d/%d\n", current_epoch+1, args.epoch);
 
-		/* create threads */
-		for (i = 0; i < args.num_threads; i++)
-			pthread_create(&threads[i], NULL, train_thread,
-					(void *) (intptr_t) i);
+		/* the epoch is finished when run_epoch() returns */
+		run_epoch();
+		ckpt.resume = 0;
 
-		/* wait for threads to join. When they join, epoch is finished
-		 */
-		for (i = 0; i < args.num_threads; i++)
-			pthread_join(threads[i], NULL);
+		if (strlen(args.checkpoint) > 0)
+			write_checkpoint(args.checkpoint, 0);
 
 		if (args.save_each_epoch)
 		{
@@ -1095,18 +5933,35 @@ int main(int argc, char **argv)
 		}
 
 	}
+	stop_pool();
+	end_phase(PHASE_TRAIN, start);
+
+	if (args.negative > 0)
+		printf("\nNegative samples rejected (strong or weak pair): %ld",
+		       negsamp_rejected);
 
 	/* save the file only if we didn't save it earlier with the
 	 * save-each-epoch option */
 	if (!args.save_each_epoch)
 	{
 		printf("\n-- Saving word embeddings\n");
+		t = wall_time();
 		save_vectors(args.output, -1);
+		end_phase(PHASE_SAVE, t);
 	}
 
 	free(table);
-	free(threads);
+	destroy_checkpoint();
+	free(sched.starts);
+	free(sched.parts);
 	destroy_vocab();
+	close_id_cache();
+	close_corpus();
+	destroy_metrics();
+	if (stream.on)
+		destroy_stream();
+	if (args.readers)
+		destroy_pipeline();
 
 	/******** end train ****/
 
@@ -1115,3 +5970,4 @@ int main(int argc, char **argv)
 
 	return 0;
 }
+#endif /* DICT2VEC_NO_MAIN */
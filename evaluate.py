@@ -103,35 +103,107 @@ def init_results():
         if not filename in results:
             results[filename] = []
 
+def load_text(filename):
+    """Read a model saved as text (.vec)"""
+    # step 0 : read the first line to get the number of words and the dimension
+    nb_line = 0
+    nb_dims = 0
+    with open(filename, encoding='utf-8') as f:
+        line = f.readline().split()
+        nb_line = int(line[0])
+        nb_dims = int(line[1])
+
+    mat = np.zeros((nb_line, nb_dims))
+    wordToNum = {}
+    count = 0
+
+    with open(filename, encoding='utf-8') as f:
+        f.readline() # skip first line because it does not contains a vector
+        for line in f:
+            line = line.split()
+            word, vals = line[0], list(map(float, line[1:]))
+            # if number of vals is different from nb_dims, bad vector, drop it
+            if len(vals) != nb_dims:
+                continue
+            mat[count] = np.array(vals)
+            wordToNum[word] = count
+            count += 1
+    return mat, wordToNum
+
+def load_word2vec(filename):
+    """Read a model saved in the binary format of word2vec (.bin)"""
+    with open(filename, 'rb') as f:
+        nb_line, nb_dims = map(int, f.readline().split())
+        mat = np.zeros((nb_line, nb_dims), dtype=np.float32)
+        wordToNum = {}
+        for count in range(nb_line):
+            word = b''
+            while True:
+                c = f.read(1)
+                if c == b' ':
+                    break
+                if c != b'\n': # newline ending the previous vector
+                    word += c
+            mat[count] = np.frombuffer(f.read(4 * nb_dims), dtype=np.float32)
+            wordToNum[word.decode('utf-8')] = count
+    return mat, wordToNum
+
+def load_native(filename):
+    """Map a model saved in the native format (.d2v). float32 vectors are not
+    copied, quantized ones are converted back to float32"""
+    vec_type = int(np.fromfile(filename, dtype=np.uint32, count=1, offset=4)[0])
+    header = np.fromfile(filename, dtype=np.uint64, count=5, offset=8)
+    nb_line, nb_dims, index_offset, words_offset, vectors_offset = map(int, header)
+    offsets = np.fromfile(filename, dtype=np.uint64, count=nb_line + 1,
+                          offset=index_offset)
+    with open(filename, 'rb') as f:
+        f.seek(words_offset)
+        words = f.read(int(offsets[-1])).split(b'\0')
+    wordToNum = {w.decode('utf-8'): i for i, w in enumerate(words[:nb_line])}
+
+    if vec_type == 1: # float32
+        mat = np.memmap(filename, dtype=np.float32, mode='r',
+                        offset=vectors_offset, shape=(nb_line, nb_dims))
+    elif vec_type == 2: # fp16
+        mat = np.memmap(filename, dtype=np.float16, mode='r',
+                        offset=vectors_offset, shape=(nb_line, nb_dims))
+        mat = mat.astype(np.float32)
+    elif vec_type == 3: # int8 with one scale per word
+        scales = np.fromfile(filename, dtype=np.float32, count=nb_line,
+                             offset=vectors_offset)
+        mat = np.fromfile(filename, dtype=np.int8, count=nb_line * nb_dims,
+                          offset=vectors_offset + 4 * nb_line)
+        mat = mat.reshape(nb_line, nb_dims) * scales[:, None]
+    else: # product quantization
+        m, ksub = map(int, np.fromfile(filename, dtype=np.uint32, count=2,
+                                       offset=vectors_offset))
+        dsub = nb_dims // m
+        centroids = np.fromfile(filename, dtype=np.float32,
+                                count=m * ksub * dsub,
+                                offset=vectors_offset + 8).reshape(m, ksub, dsub)
+        codes = np.fromfile(filename, dtype=np.uint8, count=nb_line * m,
+                            offset=vectors_offset + 8 + 4 * m * ksub * dsub)
+        codes = codes.reshape(nb_line, m)
+        mat = np.concatenate([centroids[s][codes[:, s]] for s in range(m)], axis=1)
+    return mat, wordToNum
+
+def load_model(filename):
+    """Read a model in any of the formats written by dict2vec"""
+    with open(filename, 'rb') as f:
+        magic = f.read(4)
+    if magic == b'D2VE':
+        return load_native(filename)
+    if filename.endswith('.bin'):
+        return load_word2vec(filename)
+    return load_text(filename)
+
 def evaluate(filenames):
     models = dict()
     for filename in filenames:
         model = dict()
         """Compute Cosine similarity per each file and model"""
 
-        # step 0 : read the first line to get the number of words and the dimension
-        nb_line = 0
-        nb_dims = 0
-        with open(filename, encoding='utf-8') as f:
-            line = f.readline().split()
-            nb_line = int(line[0])
-            nb_dims = int(line[1])
-
-        mat = np.zeros((nb_line, nb_dims))
-        wordToNum = {}
-        count = 0
-
-        with open(filename, encoding='utf-8') as f:
-            f.readline() # skip first line because it does not contains a vector
-            for line in f:
-                line = line.split()
-                word, vals = line[0], list(map(float, line[1:]))
-                # if number of vals is different from nb_dims, bad vector, drop it
-                if len(vals) != nb_dims:
-                    continue
-                mat[count] = np.array(vals)
-                wordToNum[word] = count
-                count += 1
+        mat, wordToNum = load_model(filename)
         model['mat'] = mat
         model['wordToNum'] = wordToNum
         models[filename] = model